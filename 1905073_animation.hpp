@@ -0,0 +1,173 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "1905073_renderer.hpp"
+#include "1905073_imageWriter.hpp"
+#include "1905073_videoStream.hpp"
+
+struct CameraKey {
+    double time;
+    Vector3D pos, l, u;
+};
+
+struct ObjectMotion {
+    // position in the scene file, counting from 0
+    int object;
+    // distance moved per unit of path time
+    Vector3D velocity;
+};
+
+/*
+ * Camera path for animation renders, read from a text file:
+ *
+ *     <frame count>
+ *     <keyframe count>
+ *     <time> <pos x y z> <look x y z> <up x y z>     (one line per keyframe)
+ *     [<moving object count>
+ *      <object> <velocity x y z>                      (one line per moving object)]
+ *
+ * Keyframes must be in increasing time. Frames are spread evenly from the
+ * first keyframe's time to the last one's. Moving objects are numbered in
+ * scene-file order and travel in a straight line from where the scene puts
+ * them at the first keyframe.
+ */
+class CameraPath {
+    vector<CameraKey> keys;
+
+public:
+    int frameCount = 0;
+    vector<ObjectMotion> motions;
+
+    bool load(string path) {
+        ifstream input(path);
+        if (!input.is_open()) {
+            cerr << "Error opening camera path " << path << endl;
+            return false;
+        }
+
+        int keyCount = 0;
+        input >> frameCount >> keyCount;
+        keys.assign(max(keyCount, 0), CameraKey());
+        for (CameraKey& k : keys) {
+            input >> k.time >> k.pos.x >> k.pos.y >> k.pos.z >> k.l.x >> k.l.y >> k.l.z >> k.u.x >> k.u.y >> k.u.z;
+        }
+
+        if (!input || frameCount <= 0 || keys.empty()) {
+            cerr << "Malformed camera path " << path << endl;
+            return false;
+        }
+
+        int motionCount = 0;
+        motions.clear();
+        if (input >> motionCount) {
+            motions.assign(max(motionCount, 0), ObjectMotion());
+            for (ObjectMotion& m : motions) input >> m.object >> m.velocity.x >> m.velocity.y >> m.velocity.z;
+            if (!input) {
+                cerr << "Malformed object motion in " << path << endl;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double timeAt(int frame) {
+        double t = keys.front().time;
+        if (frameCount > 1) t += (keys.back().time - keys.front().time) * frame / (frameCount - 1);
+        return t;
+    }
+
+    // camera of frame f: position is interpolated linearly, the orientation is re-orthonormalized after blending
+    Camera cameraAt(int frame) {
+        double t = timeAt(frame);
+
+        int k = 0;
+        while (k + 2 < (int)keys.size() && keys[k + 1].time < t) k++;
+
+        CameraKey a = keys[k], b = keys[min(k + 1, (int)keys.size() - 1)];
+        double span = b.time - a.time;
+        double s = (span > 0) ? min(max((t - a.time) / span, 0.0), 1.0) : 0.0;
+
+        Camera c;
+        c.pos = a.pos + (b.pos - a.pos) * s;
+        c.l = a.l + (b.l - a.l) * s;
+        c.l.normalize();
+        Vector3D up = a.u + (b.u - a.u) * s;
+        c.r = c.l.cross(up);
+        c.r.normalize();
+        c.u = c.r.cross(c.l);
+        return c;
+    }
+};
+
+/*
+ * Renders every frame of a camera path to frame_<n>.bmp. The scene is loaded
+ * once and the worker pool stays up for the whole path; frames go through
+ * writer, so frame n is written while frame n+1 is traced. With a stream
+ * format the frames are piped to streamTarget instead of saved (see
+ * VideoStream). Objects the path moves are updated in place between frames
+ * and the hierarchy is refit rather than rebuilt (see ObjectBvh). Returns
+ * non-zero if the path could not be read or a frame could not be written.
+ */
+int renderAnimation(string pathFile, ImageWriter& writer, string streamFormat = "", string streamTarget = "-") {
+    CameraPath path;
+    if (!path.load(pathFile)) return 1;
+
+    loadData();
+    int imageWidth = pixels, imageHeight = pixels;
+    bitmap_image image(imageWidth, imageHeight);
+
+    if (pagedMode && !path.motions.empty()) {
+        cerr << "Camera path moves objects, but the objects of a paged scene cannot move" << endl;
+        return 1;
+    }
+    for (ObjectMotion& m : path.motions) {
+        if (m.object < 0 || m.object >= (int)fileOrder.size()) {
+            cerr << "Camera path moves object " << m.object << " but the scene has " << fileOrder.size() << " objects" << endl;
+            return 1;
+        }
+    }
+    double sceneTime = path.timeAt(0);
+    int refits = sceneBvh.refits, rebuilds = sceneBvh.rebuilds;
+
+    VideoStream stream;
+    bool streaming = !streamFormat.empty();
+    if (streaming && !stream.open(streamFormat, streamTarget, imageWidth, imageHeight)) return 1;
+
+    auto start = chrono::steady_clock::now();
+    for (int f = 0; f < path.frameCount; f++) {
+        camera = path.cameraAt(f);
+        if (!path.motions.empty() && path.timeAt(f) != sceneTime) {
+            double step = path.timeAt(f) - sceneTime;
+            for (ObjectMotion& m : path.motions) translateObject(fileOrder[m.object], m.velocity * step);
+            refitScene(workers);
+            sceneTime = path.timeAt(f);
+        }
+        if (!renderImage(image, imageWidth, imageHeight)) {
+            cerr << "Animation stopped at frame " << f << ": " << pagedScene.failureReason() << endl;
+            writer.flush();
+            return 1;
+        }
+        if (!streaming) {
+            writer.submit(image, "frame_" + to_string(f) + ".bmp");
+        } else if (!stream.writeFrame(image)) {
+            cerr << "Video stream closed after " << f << " frames" << endl;
+            return 1;
+        }
+
+        cout << "Rendered frame " << f + 1 << " of " << path.frameCount << endl;
+    }
+
+    vector<string> errors = writer.flush();
+    for (string& error : errors) cerr << error << endl;
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout << "Finished animation: " << path.frameCount << " frames in " << seconds << "s" << endl;
+    if (!path.motions.empty()) {
+        cout << "Refit the object hierarchy " << sceneBvh.refits - refits << " times, rebuilt it "
+             << sceneBvh.rebuilds - rebuilds << " times" << endl;
+    }
+    if (pagedMode) cout << pagedScene.report() << endl;
+    return errors.empty() ? 0 : 1;
+}
+
+#endif // ANIMATION_H
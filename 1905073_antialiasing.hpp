@@ -0,0 +1,54 @@
+#ifndef ANTIALIASING_H
+#define ANTIALIASING_H
+
+#include "bitmap_image.hpp"
+#include "1905073_gbuffer.hpp"
+
+/*
+ * Adaptive supersampling. Every pixel first gets one sample; only pixels on
+ * an edge get more. A pixel is on an edge when a 4-neighbour hit another
+ * object than it did, or differs from it by more than contrast (in 0..1) in
+ * any channel.
+ */
+vector<char> findEdgePixels(bitmap_image& image, GBuffer& gbuffer, int width, int height, double contrast) {
+    vector<char> edge(width * height, 0);
+    int limit = contrast * 255;
+
+    const int di[] = {1, -1, 0, 0};
+    const int dj[] = {0, 0, 1, -1};
+
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) {
+            bitmap_image::rgb_t c = image.get_pixel(i, j);
+            int object = gbuffer.at(i, j).object;
+
+            for (int k = 0; k < 4 && !edge[j * width + i]; k++) {
+                int ni = i + di[k], nj = j + dj[k];
+                if (ni < 0 || ni >= width || nj < 0 || nj >= height) continue;
+
+                bitmap_image::rgb_t n = image.get_pixel(ni, nj);
+                if (gbuffer.at(ni, nj).object != object ||
+                    abs(c.red - n.red) > limit || abs(c.green - n.green) > limit || abs(c.blue - n.blue) > limit) {
+                    edge[j * width + i] = 1;
+                }
+            }
+        }
+    }
+
+    return edge;
+}
+
+// one jittered offset in [-0.5, 0.5)^2 per cell of a gridSize x gridSize grid over the pixel
+vector<pair<double, double>> stratifiedOffsets(int gridSize) {
+    vector<pair<double, double>> offsets;
+    for (int sy = 0; sy < gridSize; sy++) {
+        for (int sx = 0; sx < gridSize; sx++) {
+            double ox = (sx + nextRandom()) / gridSize - 0.5;
+            double oy = (sy + nextRandom()) / gridSize - 0.5;
+            offsets.push_back({ox, oy});
+        }
+    }
+    return offsets;
+}
+
+#endif // ANTIALIASING_H
@@ -0,0 +1,81 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+#define ARENA_BLOCK_BYTES (64 << 10)
+#define CACHE_LINE 64
+
+/*
+ * Bump allocator owning everything of one scene. Objects are placed one
+ * after another in large cache-line aligned blocks, in the order they are
+ * created, and are destroyed and freed together by release(). Nothing in
+ * an arena is freed individually.
+ */
+class SceneArena {
+    struct Block {
+        unsigned char* data;
+        size_t used, size;
+    };
+    vector<Block> blocks;
+    vector<pair<void*, void (*)(void*)>> destructors;
+    size_t bytes = 0;
+
+    void* allocate(size_t size, size_t align) {
+        if (!blocks.empty()) {
+            Block& b = blocks.back();
+            size_t offset = (b.used + align - 1) & ~(align - 1);
+            if (offset + size <= b.size) {
+                b.used = offset + size;
+                bytes += size;
+                return b.data + offset;
+            }
+        }
+
+        size_t blockSize = max((size_t)ARENA_BLOCK_BYTES, (size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1));
+        unsigned char* data = static_cast<unsigned char*>(aligned_alloc(CACHE_LINE, blockSize));
+        if (!data) throw bad_alloc();
+        blocks.push_back({data, size, blockSize});
+        bytes += size;
+        return data;
+    }
+
+public:
+    SceneArena() = default;
+    SceneArena(const SceneArena&) = delete;
+    SceneArena& operator=(const SceneArena&) = delete;
+
+    ~SceneArena() {
+        release();
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(forward<Args>(args)...);
+        if (!is_trivially_destructible<T>::value) {
+            destructors.push_back({object, [](void* p) { static_cast<T*>(p)->~T(); }});
+        }
+        return object;
+    }
+
+    // destroys every object, newest first, and returns the memory
+    void release() {
+        for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) it->second(it->first);
+        destructors.clear();
+        for (Block& b : blocks) free(b.data);
+        blocks.clear();
+        bytes = 0;
+    }
+
+    size_t bytesUsed() {
+        return bytes;
+    }
+};
+
+#endif // ARENA_H
@@ -0,0 +1,547 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include "1905073_classes.hpp"
+#include "1905073_workers.hpp"
+
+#define BVH_BINS 16
+// a refit tree is rebuilt once its SAH cost passes this multiple of its cost when built
+#define BVH_REBUILD_RATIO 1.5
+// cost of visiting a node relative to intersecting one object
+#define BVH_TRAVERSAL_COST 0.5
+// nodes one worker task refits
+#define BVH_REFIT_CHUNK 256
+
+struct BvhNode {
+    Vector3D lo, hi;
+    int left, right, parent;
+    // object index for leaves, -1 for inner nodes
+    int object;
+};
+
+/*
+ * Bounding volume hierarchy over the bounded objects, one object per leaf,
+ * split by binned SAH. Leaves hold indices into the object list rather than
+ * pointers, so the same tree serves the scene and its per-node replicas (see
+ * 1905073_numa.hpp). Unbounded objects, the floor and unclipped quadrics,
+ * are kept aside and tested for every ray.
+ *
+ * When objects move but none are added or removed, refit() recomputes the
+ * boxes bottom-up, one depth at a time on the worker pool, in time linear in
+ * the number of objects. The topology stays as built, so the tree degrades
+ * as objects drift from their neighbours; refit() returns false once the
+ * SAH cost has grown past BVH_REBUILD_RATIO times the cost after the last
+ * build, and the caller rebuilds.
+ *
+ * Single edits go through insert() and remove() instead, which only touch
+ * the path from the edited leaf to the root: a new leaf is paired with the
+ * sibling that grows the tree's area least, and every node on the way back
+ * up may swap a child with a grandchild when that shrinks its boxes.
+ */
+class ObjectBvh {
+    vector<BvhNode> nodes;
+    // slots in nodes left by removed leaves and their parents
+    vector<int> freeNodes;
+    int root = -1;
+    vector<int> unbounded;
+    // leaf of every object, -1 for unbounded ones
+    vector<int> leafOf;
+    // node indices by depth, for the level-by-level refit; recomputed after edits
+    vector<vector<int>> levels;
+    bool levelsStale = false;
+    // padded boxes and their centres, only while building
+    vector<Vector3D> boxLo, boxHi, centers;
+    double builtCost = 0;
+
+    // boxes are padded so rounding in a primitive's own test never falls outside them
+    static void pad(Vector3D& lo, Vector3D& hi) {
+        lo = Vector3D(lo.x - EPSILON * (1 + fabs(lo.x)), lo.y - EPSILON * (1 + fabs(lo.y)), lo.z - EPSILON * (1 + fabs(lo.z)));
+        hi = Vector3D(hi.x + EPSILON * (1 + fabs(hi.x)), hi.y + EPSILON * (1 + fabs(hi.y)), hi.z + EPSILON * (1 + fabs(hi.z)));
+    }
+
+    static void merge(Vector3D& lo, Vector3D& hi, Vector3D& otherLo, Vector3D& otherHi) {
+        lo = Vector3D(min(lo.x, otherLo.x), min(lo.y, otherLo.y), min(lo.z, otherLo.z));
+        hi = Vector3D(max(hi.x, otherHi.x), max(hi.y, otherHi.y), max(hi.z, otherHi.z));
+    }
+
+    // half the surface area, which is all SAH ratios need
+    static double area(Vector3D& lo, Vector3D& hi) {
+        Vector3D d = hi - lo;
+        if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+        return d.x * d.y + d.y * d.z + d.z * d.x;
+    }
+
+    static double axisOf(Vector3D& v, int axis) {
+        return (axis == 0) ? v.x : (axis == 1) ? v.y : v.z;
+    }
+
+    int build(vector<int>& order, int begin, int end, int parent, int depth) {
+        BvhNode node;
+        node.lo = Vector3D(INF, INF, INF);
+        node.hi = Vector3D(-INF, -INF, -INF);
+        node.left = node.right = node.object = -1;
+        node.parent = parent;
+
+        Vector3D centerLo(INF, INF, INF), centerHi(-INF, -INF, -INF);
+        for (int i = begin; i < end; i++) {
+            merge(node.lo, node.hi, boxLo[order[i]], boxHi[order[i]]);
+            merge(centerLo, centerHi, centers[order[i]], centers[order[i]]);
+        }
+
+        int index = nodes.size();
+        nodes.push_back(node);
+        if ((int)levels.size() <= depth) levels.resize(depth + 1);
+        levels[depth].push_back(index);
+
+        if (end - begin == 1) {
+            nodes[index].object = order[begin];
+            leafOf[order[begin]] = index;
+            return index;
+        }
+
+        // bin the centroids along their longest axis and take the cheapest boundary between bins
+        Vector3D extent = centerHi - centerLo;
+        int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+        double low = axisOf(centerLo, axis), span = axisOf(extent, axis);
+        auto binOf = [&](int k) {
+            return min(BVH_BINS - 1, (int)(BVH_BINS * (axisOf(centers[k], axis) - low) / span));
+        };
+
+        int split = -1;
+        if (span > 0) {
+            int count[BVH_BINS] = {};
+            Vector3D lo[BVH_BINS], hi[BVH_BINS];
+            for (int b = 0; b < BVH_BINS; b++) {
+                lo[b] = Vector3D(INF, INF, INF);
+                hi[b] = Vector3D(-INF, -INF, -INF);
+            }
+            for (int i = begin; i < end; i++) {
+                int b = binOf(order[i]);
+                count[b]++;
+                merge(lo[b], hi[b], boxLo[order[i]], boxHi[order[i]]);
+            }
+
+            double rightCost[BVH_BINS];
+            Vector3D accLo(INF, INF, INF), accHi(-INF, -INF, -INF);
+            int accCount = 0;
+            for (int b = BVH_BINS - 1; b > 0; b--) {
+                merge(accLo, accHi, lo[b], hi[b]);
+                accCount += count[b];
+                rightCost[b] = accCount ? accCount * area(accLo, accHi) : -1;
+            }
+
+            double best = INF;
+            accLo = Vector3D(INF, INF, INF);
+            accHi = Vector3D(-INF, -INF, -INF);
+            accCount = 0;
+            for (int b = 1; b < BVH_BINS; b++) {
+                merge(accLo, accHi, lo[b - 1], hi[b - 1]);
+                accCount += count[b - 1];
+                if (accCount == 0 || rightCost[b] < 0) continue;
+                double cost = accCount * area(accLo, accHi) + rightCost[b];
+                if (cost < best) {
+                    best = cost;
+                    split = b;
+                }
+            }
+        }
+
+        int mid;
+        if (split != -1) {
+            mid = stable_partition(order.begin() + begin, order.begin() + end,
+                                   [&](int k) { return binOf(k) < split; }) - order.begin();
+        } else {
+            // every centroid in one place: halve the range
+            mid = (begin + end) / 2;
+        }
+
+        int left = build(order, begin, mid, index, depth + 1);
+        int right = build(order, mid, end, index, depth + 1);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    void refitNode(int index, vector<Object*>& objects) {
+        BvhNode& node = nodes[index];
+        if (node.object != -1) {
+            objects[node.object]->bounds(node.lo, node.hi);
+            pad(node.lo, node.hi);
+            return;
+        }
+        refitNode(index);
+    }
+
+    int allocate() {
+        if (freeNodes.empty()) {
+            nodes.push_back(BvhNode());
+            return nodes.size() - 1;
+        }
+        int index = freeNodes.back();
+        freeNodes.pop_back();
+        return index;
+    }
+
+    void computeLevels() {
+        levels.clear();
+        if (root != -1) levels.push_back({root});
+        for (int depth = 0; depth < (int)levels.size(); depth++) {
+            vector<int> next;
+            for (int index : levels[depth]) {
+                if (nodes[index].object != -1) continue;
+                next.push_back(nodes[index].left);
+                next.push_back(nodes[index].right);
+            }
+            if (!next.empty()) levels.push_back(next);
+        }
+        levelsStale = false;
+    }
+
+    void replaceChild(int parent, int oldChild, int newChild) {
+        if (parent == -1) {
+            root = newChild;
+        } else if (nodes[parent].left == oldChild) {
+            nodes[parent].left = newChild;
+        } else {
+            nodes[parent].right = newChild;
+        }
+        nodes[newChild].parent = parent;
+    }
+
+    static double unionArea(BvhNode& a, BvhNode& b) {
+        Vector3D lo = a.lo, hi = a.hi;
+        merge(lo, hi, b.lo, b.hi);
+        return area(lo, hi);
+    }
+
+    // the leaf whose pairing with a new box grows the total area least (greedy descent)
+    int findSibling(BvhNode& leaf) {
+        int index = root;
+        while (nodes[index].object == -1) {
+            BvhNode& node = nodes[index];
+            double combined = unionArea(node, leaf);
+            double stay = 2 * combined;
+            double inherited = 2 * (combined - area(node.lo, node.hi));
+
+            double descend[2];
+            int children[2] = {node.left, node.right};
+            for (int c = 0; c < 2; c++) {
+                BvhNode& child = nodes[children[c]];
+                descend[c] = inherited + unionArea(child, leaf) - (child.object == -1 ? area(child.lo, child.hi) : 0);
+            }
+
+            if (stay < descend[0] && stay < descend[1]) break;
+            index = (descend[0] <= descend[1]) ? children[0] : children[1];
+        }
+        return index;
+    }
+
+    // Swaps a child of index with a grandchild on the other side when that
+    // shrinks the box in between the most; index's own box is unchanged.
+    void rotate(int index) {
+        BvhNode& node = nodes[index];
+        int swapChild = -1, swapGrandchild = -1, middle = -1;
+        double bestGain = 0;
+
+        int children[2] = {node.left, node.right};
+        for (int c = 0; c < 2; c++) {
+            int child = children[c], other = children[1 - c];
+            if (nodes[other].object != -1) continue;
+
+            int grandchildren[2] = {nodes[other].left, nodes[other].right};
+            for (int g = 0; g < 2; g++) {
+                // child takes grandchildren[g]'s place beside grandchildren[1 - g]
+                double gain = area(nodes[other].lo, nodes[other].hi) - unionArea(nodes[child], nodes[grandchildren[1 - g]]);
+                if (gain > bestGain) {
+                    bestGain = gain;
+                    swapChild = child;
+                    swapGrandchild = grandchildren[g];
+                    middle = other;
+                }
+            }
+        }
+        if (swapChild == -1) return;
+
+        replaceChild(middle, swapGrandchild, swapChild);
+        replaceChild(index, swapChild, swapGrandchild);
+        refitNode(middle);
+    }
+
+    void refitNode(int index) {
+        BvhNode& node = nodes[index];
+        node.lo = nodes[node.left].lo;
+        node.hi = nodes[node.left].hi;
+        merge(node.lo, node.hi, nodes[node.right].lo, nodes[node.right].hi);
+    }
+
+    // refits and rebalances every node from index up to the root
+    void repairUpwards(int index) {
+        for (; index != -1; index = nodes[index].parent) {
+            rotate(index);
+            refitNode(index);
+        }
+    }
+
+    void startBuild(int count) {
+        nodes.clear();
+        freeNodes.clear();
+        unbounded.clear();
+        levels.clear();
+        levelsStale = false;
+        leafOf.assign(count, -1);
+        boxLo.assign(count, Vector3D());
+        boxHi.assign(count, Vector3D());
+        centers.assign(count, Vector3D());
+    }
+
+    // builds over the padded boxes of order, then drops them: only build() reads them
+    void finishBuild(vector<int>& order) {
+        root = order.empty() ? -1 : build(order, 0, order.size(), -1, 0);
+        builtCost = cost();
+        vector<Vector3D>().swap(boxLo);
+        vector<Vector3D>().swap(boxHi);
+        vector<Vector3D>().swap(centers);
+    }
+
+    // distance at which the ray enters the node's box, INF when it misses it
+    static double enter(BvhNode& node, Vector3D& origin, Vector3D& inverse) {
+        double near = -INF, far = INF;
+        for (int axis = 0; axis < 3; axis++) {
+            double o = axisOf(origin, axis), inv = axisOf(inverse, axis);
+            double t0 = (axisOf(node.lo, axis) - o) * inv;
+            double t1 = (axisOf(node.hi, axis) - o) * inv;
+            if (t0 > t1) swap(t0, t1);
+            if (t0 > near) near = t0;
+            if (t1 < far) far = t1;
+        }
+        return (near <= far && far >= 0) ? near : INF;
+    }
+
+public:
+    int refits = 0, rebuilds = 0;
+
+    void build(vector<Object*>& objects) {
+        startBuild(objects.size());
+        vector<int> order;
+        for (int k = 0; k < (int)objects.size(); k++) {
+            if (!objects[k]->bounds(boxLo[k], boxHi[k])) {
+                unbounded.push_back(k);
+                continue;
+            }
+            pad(boxLo[k], boxHi[k]);
+            centers[k] = (boxLo[k] + boxHi[k]) * 0.5;
+            order.push_back(k);
+        }
+
+        finishBuild(order);
+    }
+
+    // a tree over fixed boxes instead of objects, as the pages of a paged scene
+    void build(vector<Vector3D>& lo, vector<Vector3D>& hi) {
+        startBuild(lo.size());
+        vector<int> order;
+        for (int k = 0; k < (int)lo.size(); k++) {
+            boxLo[k] = lo[k];
+            boxHi[k] = hi[k];
+            pad(boxLo[k], boxHi[k]);
+            centers[k] = (boxLo[k] + boxHi[k]) * 0.5;
+            order.push_back(k);
+        }
+        finishBuild(order);
+    }
+
+    size_t bytesUsed() {
+        size_t bytes = nodes.capacity() * sizeof(BvhNode) + (freeNodes.capacity() + unbounded.capacity() + leafOf.capacity()) * sizeof(int);
+        for (vector<int>& level : levels) bytes += level.capacity() * sizeof(int);
+        return bytes;
+    }
+
+    // adds object k, whose geometry is final, to the tree
+    void insert(int k, vector<Object*>& objects) {
+        if ((int)leafOf.size() <= k) leafOf.resize(k + 1, -1);
+
+        BvhNode leaf;
+        leaf.left = leaf.right = leaf.parent = -1;
+        leaf.object = k;
+        if (!objects[k]->bounds(leaf.lo, leaf.hi)) {
+            leafOf[k] = -1;
+            unbounded.push_back(k);
+            return;
+        }
+        pad(leaf.lo, leaf.hi);
+        levelsStale = true;
+
+        int index = allocate();
+        nodes[index] = leaf;
+        leafOf[k] = index;
+        if (root == -1) {
+            root = index;
+            return;
+        }
+
+        int sibling = findSibling(nodes[index]);
+        int parent = allocate();
+        nodes[parent].object = -1;
+        replaceChild(nodes[sibling].parent, sibling, parent);
+        nodes[parent].left = sibling;
+        nodes[parent].right = index;
+        nodes[sibling].parent = parent;
+        nodes[index].parent = parent;
+        repairUpwards(parent);
+    }
+
+    // takes object k out of the tree; its index may then be reused through renumber()
+    void remove(int k) {
+        int leaf = leafOf[k];
+        leafOf[k] = -1;
+        if (leaf == -1) {
+            unbounded.erase(find(unbounded.begin(), unbounded.end(), k));
+            return;
+        }
+        levelsStale = true;
+
+        int parent = nodes[leaf].parent;
+        freeNodes.push_back(leaf);
+        if (parent == -1) {
+            root = -1;
+            return;
+        }
+
+        int sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+        int grandparent = nodes[parent].parent;
+        freeNodes.push_back(parent);
+        replaceChild(grandparent, parent, sibling);
+        if (grandparent != -1) repairUpwards(grandparent);
+    }
+
+    // object from is now object to, for callers that fill a removed slot with the last object
+    void renumber(int from, int to) {
+        if ((int)leafOf.size() <= to) leafOf.resize(to + 1, -1);
+        leafOf[to] = leafOf[from];
+        leafOf[from] = -1;
+        if (leafOf[to] != -1) nodes[leafOf[to]].object = to;
+        else replace(unbounded.begin(), unbounded.end(), from, to);
+    }
+
+    // Recomputes every box from the objects' current geometry; false when the
+    // tree has degraded enough that it should be rebuilt.
+    bool refit(vector<Object*>& objects, WorkerPool& pool) {
+        refits++;
+        if (levelsStale) computeLevels();
+        for (int depth = (int)levels.size() - 1; depth >= 0; depth--) {
+            vector<int>& level = levels[depth];
+            if (level.size() <= BVH_REFIT_CHUNK) {
+                for (int index : level) refitNode(index, objects);
+                continue;
+            }
+
+            int tasks = (level.size() + BVH_REFIT_CHUNK - 1) / BVH_REFIT_CHUNK;
+            pool.run(tasks, [&](int task, int worker) {
+                int end = min((int)level.size(), (task + 1) * BVH_REFIT_CHUNK);
+                for (int i = task * BVH_REFIT_CHUNK; i < end; i++) refitNode(level[i], objects);
+            });
+        }
+        return cost() <= builtCost * BVH_REBUILD_RATIO;
+    }
+
+    // SAH cost of the tree relative to its root box
+    double cost() {
+        if (root == -1) return 0;
+        double rootArea = area(nodes[root].lo, nodes[root].hi);
+        if (rootArea <= 0) return 0;
+        if (levelsStale) computeLevels();
+
+        double total = 0;
+        for (vector<int>& level : levels) {
+            for (int index : level) {
+                BvhNode& node = nodes[index];
+                total += area(node.lo, node.hi) * (node.object == -1 ? BVH_TRAVERSAL_COST : 1.0);
+            }
+        }
+        return total / rootArea;
+    }
+
+    // Nearest object hit at a distance in (0, tmin), or -1; tmin is lowered to
+    // that distance. hit(k) intersects object k. On equal distances the lower
+    // index wins, as it does in a scan over all objects.
+    template <typename Hit>
+    int nearest(Ray& ray, double& tmin, Hit hit) {
+        int found = -1;
+        auto consider = [&](int k) {
+            double t = hit(k);
+            if (t > 0 && (t < tmin || (t == tmin && k < found))) {
+                found = k;
+                tmin = t;
+            }
+        };
+
+        for (int k : unbounded) consider(k);
+        if (root == -1) return found;
+
+        Vector3D origin = ray.getOrigin(), d = ray.getDirection();
+        Vector3D inverse(1.0 / d.x, 1.0 / d.y, 1.0 / d.z);
+
+        static thread_local vector<pair<int, double>> stack;
+        stack.clear();
+        double rootEntry = enter(nodes[root], origin, inverse);
+        if (rootEntry != INF) stack.push_back({root, rootEntry});
+
+        while (!stack.empty()) {
+            auto [index, entry] = stack.back();
+            stack.pop_back();
+            if (entry > tmin) continue;
+
+            BvhNode& node = nodes[index];
+            if (node.object != -1) {
+                consider(node.object);
+                continue;
+            }
+
+            // visit the nearer child first so the farther one is often culled
+            double left = enter(nodes[node.left], origin, inverse);
+            double right = enter(nodes[node.right], origin, inverse);
+            if (left <= right) {
+                if (right != INF) stack.push_back({node.right, right});
+                if (left != INF) stack.push_back({node.left, left});
+            } else {
+                if (left != INF) stack.push_back({node.left, left});
+                if (right != INF) stack.push_back({node.right, right});
+            }
+        }
+        return found;
+    }
+
+    // Some object hit at a distance in (0, tmax), or -1; for shadow rays, where any blocker will do.
+    template <typename Hit>
+    int any(Ray& ray, double tmax, Hit hit) {
+        for (int k : unbounded) {
+            double t = hit(k);
+            if (t > 0 && t < tmax) return k;
+        }
+        if (root == -1) return -1;
+
+        Vector3D origin = ray.getOrigin(), d = ray.getDirection();
+        Vector3D inverse(1.0 / d.x, 1.0 / d.y, 1.0 / d.z);
+
+        static thread_local vector<int> stack;
+        stack.clear();
+        stack.push_back(root);
+
+        while (!stack.empty()) {
+            BvhNode& node = nodes[stack.back()];
+            stack.pop_back();
+            if (enter(node, origin, inverse) > tmax) continue;
+
+            if (node.object != -1) {
+                double t = hit(node.object);
+                if (t > 0 && t < tmax) return node.object;
+                continue;
+            }
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+        }
+        return -1;
+    }
+};
+
+#endif // BVH_H
@@ -12,7 +12,7 @@
 
 using namespace std;
 
-#define PI 2 * acos(0.0)
+#define PI 3.14159265358979323846
 #define INF std::numeric_limits<double>::infinity()
 #define EPSILON 0.0000001
 
@@ -24,6 +24,10 @@ class Ray;
 
 class Light;
 
+class RenderLight;
+
+class LightVisibility;
+
 class Object;
 
 class ReflectionCoefficients;
@@ -36,6 +40,8 @@ class GeneralQuadricSurface;
 
 class Floor;
 
+class SceneArena;
+
 class Color {
     double normalize(double value) {
         return (value > 1.0) ? 1.0 : (value < 0.0) ? 0.0 : value;
@@ -80,10 +86,10 @@ public:
         return Color(r * c.getR(), g * c.getG(), b * c.getB());
     }
 
-    friend std::ifstream &operator>>(std::ifstream &in, Color &c);
+    friend std::istream &operator>>(std::istream &in, Color &c);
 };
 
-std::ifstream &operator>>(std::ifstream &in, Color &c) {
+std::istream &operator>>(std::istream &in, Color &c) {
     in >> c.r >> c.g >> c.b;
     return in;
 }
@@ -159,33 +165,37 @@ public:
     }
 
 
-    friend std::ifstream &operator>>(std::ifstream &in, const Vector3D &v);
+    friend std::istream &operator>>(std::istream &in, const Vector3D &v);
 };
 
-std::ifstream &operator>>(std::ifstream &in, Vector3D &v) {
+std::istream &operator>>(std::istream &in, Vector3D &v) {
     in >> v.x >> v.y >> v.z;
     return in;
 }
 
 class Ray {
     Vector3D origin, direction;
+    // product of kr along the path that spawned this ray
+    double weight;
 
 public:
-    Ray() {
+    Ray() : weight(1.0) {
         origin = Vector3D(0.0, 0.0, 0.0);
         direction = Vector3D(0.0, 0.0, 0.0);
     }
 
-    Ray(Vector3D origin, Vector3D direction) : origin(origin) {
+    Ray(Vector3D origin, Vector3D direction, double weight = 1.0) : origin(origin), weight(weight) {
         direction.normalize();
         this->direction = direction;
     }
 
     Vector3D getOrigin() { return origin; }
     Vector3D getDirection() { return direction; }
+    double getWeight() { return weight; }
 
     void setOrigin(Vector3D &origin) { this->origin = origin; }
     void setDirection(Vector3D &direction) { this->direction = direction; }
+    void setWeight(double weight) { this->weight = weight; }
 
     Vector3D getPointAtParameter(double t) {
         return origin + (direction*t);
@@ -214,10 +224,70 @@ public:
     double getSpotCutoff() const;
     Color getColor() const;
     Vector3D getLightPos() const;
+    void setLightPos(Vector3D pos);
     void draw();
 
 };
 
+// Light compiled for rendering: spot axis normalized and the cutoff kept as a cosine
+class RenderLight {
+public:
+    Vector3D pos, axis;
+    Color color;
+    double cosCutoff;
+    bool isSpot;
+    // position in lights, shading accumulates lights in this order
+    int id;
+
+    RenderLight(Light& l, int id) : pos(l.getLightPos()), axis(l.getSpotDirection()), color(l.getColor()),
+                                    cosCutoff(-1.0), isSpot(l.isSpotLight()), id(id) {
+        if (isSpot) {
+            axis.normalize();
+            cosCutoff = cos(l.getSpotCutoff() * PI / 180);
+        }
+    }
+
+    // Cheap test run before any shadow ray: false when the point is outside
+    // the cone or the surface faces away. Leaves the unit vector towards the
+    // light in lightDir.
+    bool canReach(Vector3D& point, Vector3D& normal, Vector3D& lightDir) {
+        if (isSpot) {
+            Vector3D d = point - pos;
+            if (d.dot(axis) < cosCutoff * sqrt(d.dot(d))) return false;
+        }
+
+        lightDir = pos - point;
+        lightDir.normalize();
+        return normal.dot(lightDir) > 0;
+    }
+};
+
+#define LIGHT_BATCH 8
+
+// Lights that reach one hit, stored component by component so the shading
+// kernel evaluates up to LIGHT_BATCH of them per pass. Only the first count
+// lanes are set.
+class LightBatch {
+public:
+    // unit vector towards each light
+    double dx[LIGHT_BATCH], dy[LIGHT_BATCH], dz[LIGHT_BATCH];
+    // light colour times its sampling weight
+    double r[LIGHT_BATCH], g[LIGHT_BATCH], b[LIGHT_BATCH];
+    int count = 0;
+
+    bool full() { return count == LIGHT_BATCH; }
+
+    void add(Vector3D& lightDir, Color color) {
+        dx[count] = lightDir.x;
+        dy[count] = lightDir.y;
+        dz[count] = lightDir.z;
+        r[count] = color.getR();
+        g[count] = color.getG();
+        b[count] = color.getB();
+        count++;
+    }
+};
+
 class ReflectionCoefficients {
     double ka, kd, ks, kr;
 
@@ -236,56 +306,86 @@ public:
     void setKs(double ks) { this->ks = ks; }
     void setKr(double kr) { this->kr = kr; }
 
-    friend std::ifstream &operator>>(std::ifstream &in, ReflectionCoefficients &coefficients);
+    friend std::istream &operator>>(std::istream &in, ReflectionCoefficients &coefficients);
 };
 
-std::ifstream &operator>>(std::ifstream &in, ReflectionCoefficients &coefficients) {
+std::istream &operator>>(std::istream &in, ReflectionCoefficients &coefficients) {
     in >> coefficients.ka >> coefficients.kd >> coefficients.ks >> coefficients.kr;
     return in;
 }
 
+// the closed set of primitives, see visitPrimitive
+enum PrimitiveKind { KIND_OBJECT, KIND_SPHERE, KIND_TRIANGLE, KIND_QUADRIC, KIND_FLOOR };
+
+// flat copy of an object, as paged scenes store it on disk (see 1905073_pagedScene.hpp)
+struct PrimitiveRecord {
+    int32_t kind, shine, maxReflectionDepth, unused;
+    double color[3], coefficients[4];
+    double reference[3], length, width, height;
+    // sphere: radius; triangle: the three vertices; quadric: A to J
+    double shape[10];
+};
+
 class Object {
 protected:
+    PrimitiveKind kind = KIND_OBJECT;
+
     Color color;
     ReflectionCoefficients coefficients;
 
     Vector3D reference_point;
     
-    int shine;
-    double height, width, length;
+    int shine = 0;
+    double height = 0, width = 0, length = 0;
+
+    // highest level this material still reflects from, -1 leaves it to recursion_level
+    int maxReflectionDepth = -1;
 
 public:
     Object() = default;
+    Object(PrimitiveKind kind) : kind(kind) {}
+    virtual ~Object() = default;
+    PrimitiveKind getKind() { return kind; }
     virtual void draw();
     virtual double intersect(Ray r, Color clr, int level);
     virtual Vector3D getNormalAt(Vector3D intersectionPoint);
     virtual Color getColorAt(Vector3D intersectionPoint);
+    virtual unsigned long long hashContents(unsigned long long h);
+    // copy of the object placed in arena
+    virtual Object* clone(SceneArena& arena);
+    virtual void encode(PrimitiveRecord& r);
+    // object of record r placed in arena, nullptr for an unknown kind
+    static Object* decode(PrimitiveRecord& r, SceneArena& arena);
+    // representative point for spatial ordering; false for unbounded primitives
+    virtual bool centroid(Vector3D& c);
+    // axis-aligned box around the object; false for unbounded primitives
+    virtual bool bounds(Vector3D& lo, Vector3D& hi);
+    Vector3D getReferencePoint() { return reference_point; }
     void setColor(Color c);
     void setColor(double c1, double c2, double c3);
     void setShine(int s);
     void setCoefficients(double c1, double c2, double c3, double c4);
     void setCoefficients(ReflectionCoefficients c);
+    ReflectionCoefficients getCoefficients();
+    void setMaxReflectionDepth(int depth);
     double getLength();
-    double intersectWithIllumination(Ray& r, Color& clr, int level);
+    Color getLocalIllumination(Ray& r, double tmin, Vector3D& intersectionPoint, Vector3D& normal, LightVisibility* visibility = nullptr);
     Color calculateAmbientColor(Vector3D& intersectionPoint);
     Vector3D calculateAndNormalizeNormal(Vector3D& intersectionPoint);
-    void handleLightSource(Vector3D& normal, Vector3D& intersectionPoint, Color& clr, double tmin, Vector3D& rd);
-    bool isInShadow(Ray& lightRay, double tmin);
-    void calculateLambertAndPhong(Vector3D& normal, Vector3D& lightDir, Color& clr, Light& l, double& lambert, double& phong, Vector3D& rd, Vector3D& intersectionPoint);
-    void handleDiffuseAndSpecular(Color& clr, Light& l, double lambert, double phong, Vector3D& intersectionPoint);
-    void handleRecursiveReflection(Vector3D& rd, Color& clr, Vector3D& intersectionPoint, Vector3D& normal, int level);
+    void handleLightSource(Vector3D& normal, Vector3D& intersectionPoint, Color& clr, double tmin, Vector3D& rd, LightVisibility* visibility);
+    bool isInShadow(Ray& lightRay, double tmin, int lightId);
+    void shadeLights(LightBatch& batch, Vector3D& normal, Vector3D& rd, Color& clr, Vector3D& intersectionPoint);
+    bool spawnsReflection(Ray& r, int level);
     Ray get_reflectedRay(Vector3D& intersectionPoint, Vector3D& normal, Vector3D& rd);
-    void handleReflectedColor(Ray& rayReflected, Color& clr, int level);
-    int getNearestIntersectingObject(Ray& rayReflected, Color& colorReflected);
 };
 
 
-class Sphere : public Object {
+class Sphere final : public Object {
 private:
     double radius;
 
 public:
-    Sphere(Vector3D center, double radius) : Object(), radius(radius) {
+    Sphere(Vector3D center, double radius) : Object(KIND_SPHERE), radius(radius) {
         reference_point = center;
         length = radius;
     }
@@ -294,24 +394,29 @@ public:
     void draw() override;
     double intersect(Ray r, Color clr, int level) override;
     Vector3D getNormalAt(Vector3D intersectionPoint) override;
+    unsigned long long hashContents(unsigned long long h) override;
+    Object* clone(SceneArena& arena) override;
+    void encode(PrimitiveRecord& r) override;
+    bool bounds(Vector3D& lo, Vector3D& hi) override;
     
 
     // Getters and setters
     double getRadius() const { return radius; }
     void setRadius(double r) { radius = r; }
+    void setCenter(Vector3D center) { reference_point = center; }
 
     // Destructor
     ~Sphere() = default;
 };
 
-class Triangle : public Object {
+class Triangle final : public Object {
     Vector3D v1, v2, v3;
 
 public:
-    Triangle() {}
+    Triangle() : Object(KIND_TRIANGLE) {}
 
     Triangle(Vector3D v1, Vector3D v2, Vector3D v3)
-        : v1(v1), v2(v2), v3(v3){}
+        : Object(KIND_TRIANGLE), v1(v1), v2(v2), v3(v3){}
 
     Vector3D &getv1() { return v1; }
     Vector3D &getv2() { return v2; }
@@ -321,19 +426,30 @@ public:
     void setv2(Vector3D &v2) { this->v2 = v2; }
     void setv3(Vector3D &v3) { this->v3 = v3; }
 
+    void setVertices(Vector3D a, Vector3D b, Vector3D c) {
+        v1 = a;
+        v2 = b;
+        v3 = c;
+    }
+
     void draw() override;
     double intersect(Ray r, Color clr, int level) override;
     Vector3D getNormalAt(Vector3D intersectionPoint) override;
+    unsigned long long hashContents(unsigned long long h) override;
+    Object* clone(SceneArena& arena) override;
+    void encode(PrimitiveRecord& r) override;
+    bool centroid(Vector3D& c) override;
+    bool bounds(Vector3D& lo, Vector3D& hi) override;
 };
 
-class GeneralQuadricSurface : public Object {
+class GeneralQuadricSurface final : public Object {
 private:
     double A, B, C, D, E, F, G, H, I, J;
 
 public:
     GeneralQuadricSurface(double a, double b, double c, double d, double e, double f, double g, double h, double i, double j,
                       double length, double width, double height, Vector3D ref)
-    : A(a), B(b), C(c), D(d), E(e), F(f), G(g), H(h), I(i), J(j){
+    : Object(KIND_QUADRIC), A(a), B(b), C(c), D(d), E(e), F(f), G(g), H(h), I(i), J(j){
         this->length = length;
         this->width = width;
         this->height = height;
@@ -363,15 +479,22 @@ public:
     void setJ(double J) { this->J = J; }
 
     bool withinReferenceCube(Vector3D p);
+    // moves the surface together with its clipping box
+    void setReferencePoint(Vector3D ref);
     double intersect(Ray r, Color clr, int level) override;
     Vector3D getNormalAt(Vector3D intersectionPoint) override;
+    unsigned long long hashContents(unsigned long long h) override;
+    Object* clone(SceneArena& arena) override;
+    void encode(PrimitiveRecord& r) override;
+    bool centroid(Vector3D& c) override;
+    bool bounds(Vector3D& lo, Vector3D& hi) override;
 
 };
 
 
-class Floor : public Object {
+class Floor final : public Object {
 public:
-    Floor(double floorWidth, double tileWidth) {
+    Floor(double floorWidth, double tileWidth) : Object(KIND_FLOOR) {
         reference_point = {-floorWidth / 2, -floorWidth / 2, 0};
         length = tileWidth;
     }
@@ -385,6 +508,9 @@ public:
     double intersect(Ray r, Color clr, int level) override;
     void draw() override;
     bool isPointWithinBounds(Vector3D point) ;
+    unsigned long long hashContents(unsigned long long h) override;
+    Object* clone(SceneArena& arena) override;
+    bool centroid(Vector3D& c) override;
     
     Vector3D getNormalAt(Vector3D intersectionPoint) override {
         return Vector3D(0, 0, 1);
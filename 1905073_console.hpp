@@ -0,0 +1,172 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include "1905073_renderer.hpp"
+
+// command files running command files, deeper than this is taken for a cycle
+#define MAX_COMMAND_FILE_DEPTH 16
+
+bool runCommandFile(string path, function<bool(string)> appCommand);
+
+void listScene() {
+    for (int k = 0; k < (int)objects.size(); k++) {
+        Object* o = objects[k];
+        const char* kinds[] = {"object", "sphere", "triangle", "general", "floor"};
+        Vector3D c;
+        cout << "object " << k << ": " << kinds[o->getKind()];
+        if (o->centroid(c)) cout << " at " << c.x << " " << c.y << " " << c.z;
+        cout << endl;
+    }
+    for (int k = 0; k < (int)lights.size(); k++) {
+        Vector3D p = lights[k].getLightPos();
+        cout << "light " << k << ": " << (lights[k].isSpotLight() ? "spotlight" : "point") << " at " << p.x << " " << p.y << " " << p.z << endl;
+    }
+}
+
+/*
+ * Runs one scene edit command; these are typed into the console of the
+ * interactive app or listed in a command file, one per line:
+ *
+ *     add sphere|triangle|general <fields as in scene.txt>
+ *     add light <position> <colour>
+ *     add spotlight <position> <colour> <direction> <cutoff>
+ *     remove object|light <index>
+ *     move object|light <index> <dx dy dz>
+ *     list
+ *     run <command file>
+ *
+ * Objects and lights are numbered as list prints them; removing one gives
+ * its number to the last object. Only the lights of a paged scene can be
+ * edited. Blank lines and lines starting with # are
+ * skipped. Anything else is offered to appCommand, which returns false for
+ * commands it does not know either. Returns false on a bad command.
+ */
+bool runSceneCommand(string line, function<bool(string)> appCommand = nullptr) {
+    istringstream input(line);
+    string command, what;
+    if (!(input >> command) || command[0] == '#') return true;
+
+    auto fail = [&](string reason) {
+        cerr << reason << ": " << line << endl;
+        return false;
+    };
+
+    if (command == "list") {
+        listScene();
+        return true;
+    }
+    if (command == "run") {
+        string path;
+        if (!(input >> path)) return fail("Missing command file");
+        return runCommandFile(path, appCommand);
+    }
+
+    if (command == "add") {
+        streampos fields = input.tellg();
+        if (!(input >> what)) return fail("Missing what to add");
+
+        if (what == "light" || what == "spotlight") {
+            Light light = (what == "light") ? createLight(input) : createSpotLight(input);
+            if (!input) return fail("Malformed light");
+            addLight(light);
+            history.invalidate();
+            cout << "Added light, the scene has " << lights.size() << " lights" << endl;
+            return true;
+        }
+
+        if (pagedMode) return fail("Objects of a paged scene cannot be edited");
+        input.seekg(fields);
+        Object* object = readObject(input);
+        if (!object) return fail("Unknown object shape");
+        readAndSetProperties(object, input);
+        string extra;
+        if (!input || input >> extra) {
+            delete object;
+            return fail("Malformed object");
+        }
+        cout << "Added object " << addObject(object) << endl;
+        return true;
+    }
+
+    if (command == "remove" || command == "move") {
+        int index;
+        Vector3D offset;
+        if (!(input >> what >> index)) return fail("Missing object or light number");
+        if (command == "move" && !(input >> offset)) return fail("Missing offset");
+
+        if (what == "object") {
+            if (pagedMode) return fail("Objects of a paged scene cannot be edited");
+            if (index < 0 || index >= (int)objects.size()) return fail("No such object");
+            if (command == "remove") removeObject(index);
+            else if (!moveObject(index, offset)) return fail("Object cannot be moved");
+        } else if (what == "light") {
+            if (index < 0 || index >= (int)lights.size()) return fail("No such light");
+            if (command == "remove") removeLight(index);
+            else moveLight(index, offset);
+            history.invalidate();
+        } else {
+            return fail("Expected object or light");
+        }
+        cout << (command == "remove" ? "Removed " : "Moved ") << what << " " << index << endl;
+        return true;
+    }
+
+    if (appCommand && appCommand(command)) return true;
+    return fail("Unknown command");
+}
+
+// runs every line of a command file, carrying on past bad ones; false if any failed
+bool runCommandFile(string path, function<bool(string)> appCommand) {
+    static int depth = 0;
+    if (depth >= MAX_COMMAND_FILE_DEPTH) {
+        cerr << "Command files nested more than " << MAX_COMMAND_FILE_DEPTH << " deep, not running " << path << endl;
+        return false;
+    }
+    ifstream input(path);
+    if (!input) {
+        cerr << "Unable to open command file " << path << endl;
+        return false;
+    }
+
+    depth++;
+    bool ok = true;
+    string line;
+    while (getline(input, line)) ok = runSceneCommand(line, appCommand) && ok;
+    depth--;
+    return ok;
+}
+
+/*
+ * Console lines for the interactive app. A thread of its own blocks on
+ * stdin so the GLUT loop never does; the loop collects finished lines with
+ * take() and runs them between frames. The state is shared with the
+ * thread, which is never joined and may outlive the console at exit.
+ */
+class CommandConsole {
+    struct Pending {
+        mutex lock;
+        deque<string> lines;
+    };
+    shared_ptr<Pending> pending = make_shared<Pending>();
+
+public:
+    void start() {
+        shared_ptr<Pending> shared = pending;
+        thread([shared] {
+            string line;
+            while (getline(cin, line)) {
+                lock_guard<mutex> guard(shared->lock);
+                shared->lines.push_back(line);
+            }
+        }).detach();
+    }
+
+    vector<string> take() {
+        lock_guard<mutex> guard(pending->lock);
+        vector<string> lines(pending->lines.begin(), pending->lines.end());
+        pending->lines.clear();
+        return lines;
+    }
+};
+
+#endif // CONSOLE_H
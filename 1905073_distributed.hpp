@@ -0,0 +1,348 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <chrono>
+#include "1905073_renderer.hpp"
+#include "1905073_net.hpp"
+
+#define DIST_TILE 64
+// tiles a worker is given ahead, so it never idles waiting for the next one
+#define TILES_IN_FLIGHT 2
+// seconds a worker may hold tiles without answering before it counts as dead
+#define WORKER_TIMEOUT 60
+// seconds the coordinator waits for workers to connect
+#define CONNECT_TIMEOUT 30
+
+enum TileMessage : uint32_t {
+    MSG_SCENE = 1,   // scene text, content hash, image size, render settings
+    MSG_READY,       // worker loaded the scene and its hash matched
+    MSG_TILE,        // tile id and pixel rectangle to trace
+    MSG_TILE_DONE,   // tile id and rgb bytes
+    MSG_FINISH,      // no more tiles
+    MSG_ERROR        // text
+};
+
+// the settings renderImage depends on besides the scene itself
+void putRenderSettings(MessageBuffer& m) {
+    for (Vector3D v : {camera.pos, camera.l, camera.r, camera.u}) {
+        m.put(v.x), m.put(v.y), m.put(v.z);
+    }
+    m.put<int32_t>(windowWidth);
+    m.put<int32_t>(windowHeight);
+    m.put(viewAngle);
+    m.put<int32_t>(recursion_level);
+    m.put(reflection_threshold);
+    m.put<uint8_t>(manyLightMode);
+    m.put<int32_t>(lightSampleBudget);
+}
+
+bool getRenderSettings(MessageBuffer& m) {
+    for (Vector3D* v : {&camera.pos, &camera.l, &camera.r, &camera.u}) {
+        v->x = m.get<double>(), v->y = m.get<double>(), v->z = m.get<double>();
+    }
+    windowWidth = m.get<int32_t>();
+    windowHeight = m.get<int32_t>();
+    viewAngle = m.get<double>();
+    recursion_level = m.get<int32_t>();
+    reflection_threshold = m.get<double>();
+    manyLightMode = m.get<uint8_t>();
+    lightSampleBudget = m.get<int32_t>();
+    return !m.failed;
+}
+
+struct TileRect {
+    int x0, y0, x1, y1;
+};
+
+TileRect tileRect(int tile, int imageWidth, int imageHeight) {
+    int tilesX = (imageWidth + DIST_TILE - 1) / DIST_TILE;
+    int x0 = (tile % tilesX) * DIST_TILE, y0 = (tile / tilesX) * DIST_TILE;
+    return {x0, y0, min(x0 + DIST_TILE, imageWidth), min(y0 + DIST_TILE, imageHeight)};
+}
+
+void copyTile(bitmap_image& image, TileRect r, vector<unsigned char>& rgb) {
+    int p = 0;
+    for (int j = r.y0; j < r.y1; j++) {
+        for (int i = r.x0; i < r.x1; i++, p += 3) image.set_pixel(i, j, rgb[p], rgb[p + 1], rgb[p + 2]);
+    }
+}
+
+struct RemoteWorker {
+    int fd;
+    bool ready = false, alive = true;
+    deque<int> inFlight;
+    MessageReader reader;
+    // last whole message (or tile sent), and first byte of the message being read
+    chrono::steady_clock::time_point lastHeard, messageStarted;
+};
+
+/*
+ * Coordinator side of distributed rendering. Waits for up to workerCount
+ * workers on port, sends each the scene text with its content hash and the
+ * render settings, then deals out DIST_TILE tiles on demand and assembles
+ * the answers into image. Sockets are read without blocking, so one stuck
+ * worker cannot stall the rest. When a worker disconnects, errors, stops
+ * halfway through a message or owes an answer (MSG_READY or tiles in
+ * flight) for WORKER_TIMEOUT seconds, its tiles go back to the queue; if no
+ * worker is left the remaining tiles are traced locally. The result is
+ * byte-identical to a local per-pixel render of the same view.
+ */
+bool renderDistributed(int port, int workerCount, string scenePath, bitmap_image& image, int imageWidth, int imageHeight) {
+    ifstream sceneFile(scenePath, ios::binary);
+    string sceneText((istreambuf_iterator<char>(sceneFile)), istreambuf_iterator<char>());
+    if (sceneText.empty()) {
+        cerr << "Unable to read " << scenePath << " for the workers" << endl;
+        return false;
+    }
+
+    int listener = listenTcp(port);
+    if (listener < 0) {
+        cerr << "Unable to listen on port " << port << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    MessageBuffer scene;
+    scene.putString(sceneText);
+    scene.put<uint64_t>(sceneContentHash());
+    scene.put<int32_t>(imageWidth);
+    scene.put<int32_t>(imageHeight);
+    putRenderSettings(scene);
+
+    vector<RemoteWorker> remotes;
+    auto deadline = chrono::steady_clock::now() + chrono::seconds(CONNECT_TIMEOUT);
+    while ((int)remotes.size() < workerCount && chrono::steady_clock::now() < deadline) {
+        pollfd p = {listener, POLLIN, 0};
+        if (poll(&p, 1, 200) <= 0) continue;
+
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        // a worker that stops reading fails our sends instead of blocking them
+        timeval sendTimeout = {WORKER_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+
+        if (!sendMessage(fd, MSG_SCENE, scene)) {
+            cerr << "Unable to send the scene to a worker: " << strerror(errno) << endl;
+            close(fd);
+            continue;
+        }
+        RemoteWorker remote;
+        remote.fd = fd;
+        remote.lastHeard = remote.messageStarted = chrono::steady_clock::now();
+        remotes.push_back(remote);
+        cout << "Worker " << remotes.size() << " of " << workerCount << " connected" << endl;
+    }
+    close(listener);
+
+    int tileCount = ((imageWidth + DIST_TILE - 1) / DIST_TILE) * ((imageHeight + DIST_TILE - 1) / DIST_TILE);
+    deque<int> pending(tileCount);
+    iota(pending.begin(), pending.end(), 0);
+    vector<char> finished(tileCount, 0);
+    int finishedCount = 0;
+
+    auto drop = [&](RemoteWorker& remote, string reason) {
+        cerr << "Dropping worker: " << reason << ", re-issuing " << remote.inFlight.size() << " tiles" << endl;
+        for (int tile : remote.inFlight) pending.push_front(tile);
+        remote.inFlight.clear();
+        remote.alive = false;
+        close(remote.fd);
+    };
+
+    auto dealTiles = [&](RemoteWorker& remote) {
+        while (remote.alive && remote.ready && remote.inFlight.size() < TILES_IN_FLIGHT && !pending.empty()) {
+            int tile = pending.front();
+            pending.pop_front();
+            if (finished[tile]) continue;
+
+            TileRect r = tileRect(tile, imageWidth, imageHeight);
+            MessageBuffer m;
+            m.put<int32_t>(tile);
+            for (int v : {r.x0, r.y0, r.x1, r.y1}) m.put<int32_t>(v);
+
+            remote.inFlight.push_back(tile);
+            remote.lastHeard = chrono::steady_clock::now();
+            if (!sendMessage(remote.fd, MSG_TILE, m)) drop(remote, "connection lost");
+        }
+    };
+
+    MessageBuffer message;
+    auto handle = [&](RemoteWorker& remote, uint32_t type) {
+        if (type == MSG_READY) {
+            remote.ready = true;
+        } else if (type == MSG_TILE_DONE) {
+            int tile = message.get<int32_t>();
+            vector<unsigned char> rgb = message.getBytes();
+            auto position = find(remote.inFlight.begin(), remote.inFlight.end(), tile);
+            if (message.failed || position == remote.inFlight.end()) {
+                drop(remote, "malformed tile");
+                return;
+            }
+
+            TileRect r = tileRect(tile, imageWidth, imageHeight);
+            if (rgb.size() != (size_t)(r.x1 - r.x0) * (r.y1 - r.y0) * 3) {
+                drop(remote, "malformed tile");
+                return;
+            }
+
+            remote.inFlight.erase(position);
+            if (!finished[tile]) {
+                copyTile(image, r, rgb);
+                finished[tile] = 1;
+                finishedCount++;
+            }
+        } else if (type == MSG_ERROR) {
+            drop(remote, message.getString());
+        }
+    };
+
+    while (finishedCount < tileCount) {
+        vector<pollfd> fds;
+        vector<RemoteWorker*> polled;
+        for (RemoteWorker& remote : remotes) {
+            if (!remote.alive) continue;
+            fds.push_back({remote.fd, POLLIN, 0});
+            polled.push_back(&remote);
+        }
+
+        // nobody left to hand tiles to: finish the image here
+        if (fds.empty()) {
+            cerr << "No workers left, tracing " << tileCount - finishedCount << " tiles locally" << endl;
+            vector<unsigned char> rgb;
+            for (int tile = 0; tile < tileCount; tile++) {
+                if (finished[tile]) continue;
+                TileRect r = tileRect(tile, imageWidth, imageHeight);
+                if (!tracePixelBlock(imageWidth, imageHeight, r.x0, r.y0, r.x1, r.y1, rgb)) {
+                    cerr << "Unable to trace the remaining tiles: " << pagedScene.failureReason() << endl;
+                    return false;
+                }
+                copyTile(image, r, rgb);
+                finished[tile] = 1;
+                finishedCount++;
+            }
+            break;
+        }
+
+        poll(fds.data(), fds.size(), 1000);
+        auto now = chrono::steady_clock::now();
+
+        for (size_t k = 0; k < fds.size(); k++) {
+            RemoteWorker& remote = *polled[k];
+
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!remote.reader.waiting()) remote.messageStarted = now;
+                if (!remote.reader.receive(remote.fd)) {
+                    drop(remote, "connection lost");
+                    continue;
+                }
+                uint32_t type;
+                while (remote.alive && remote.reader.next(type, message)) {
+                    remote.lastHeard = now;
+                    remote.messageStarted = now;
+                    handle(remote, type);
+                }
+                if (!remote.alive) continue;
+                if (remote.reader.oversized) {
+                    drop(remote, "oversized message");
+                    continue;
+                }
+            }
+
+            // a worker owes an answer until it is ready and while it holds tiles
+            bool owing = !remote.ready || !remote.inFlight.empty();
+            if (remote.reader.waiting() && now - remote.messageStarted > chrono::seconds(WORKER_TIMEOUT)) {
+                drop(remote, "stalled mid-message");
+            } else if (owing && now - remote.lastHeard > chrono::seconds(WORKER_TIMEOUT)) {
+                drop(remote, remote.ready ? "timed out" : "never became ready");
+            }
+        }
+
+        for (RemoteWorker& remote : remotes) dealTiles(remote);
+    }
+
+    for (RemoteWorker& remote : remotes) {
+        if (!remote.alive) continue;
+        sendMessage(remote.fd, MSG_FINISH, MessageBuffer());
+        close(remote.fd);
+    }
+    return true;
+}
+
+/*
+ * Worker side: connects to the coordinator (retrying while it starts up),
+ * loads the scene it is sent, checks the content hash, and traces tiles
+ * with the local worker pool until told to finish.
+ */
+int runTileWorker(string host, int port) {
+    int fd = -1;
+    for (int attempt = 0; attempt < CONNECT_TIMEOUT * 5 && fd < 0; attempt++) {
+        fd = connectTcp(host, port);
+        if (fd < 0) this_thread::sleep_for(chrono::milliseconds(200));
+    }
+    if (fd < 0) {
+        cerr << "Unable to reach coordinator " << host << ":" << port << endl;
+        return 1;
+    }
+
+    auto fail = [&](string error) {
+        cerr << error << endl;
+        MessageBuffer m;
+        m.putString(error);
+        sendMessage(fd, MSG_ERROR, m);
+        close(fd);
+        return 1;
+    };
+
+    uint32_t type;
+    MessageBuffer message;
+    if (!receiveMessage(fd, type, message) || type != MSG_SCENE) return fail("Expected a scene from the coordinator");
+
+    string sceneText = message.getString();
+    unsigned long long expectedHash = message.get<uint64_t>();
+    int imageWidth = message.get<int32_t>();
+    int imageHeight = message.get<int32_t>();
+    if (!getRenderSettings(message)) return fail("Malformed scene message");
+
+    char scenePath[] = "/tmp/rt_scene_XXXXXX";
+    int sceneFd = mkstemp(scenePath);
+    if (sceneFd < 0 || write(sceneFd, sceneText.data(), sceneText.size()) != (ssize_t)sceneText.size()) {
+        return fail("Unable to store the scene locally");
+    }
+    close(sceneFd);
+
+    // loadData also reads recursion_level from the scene; keep the coordinator's
+    int level = recursion_level;
+    loadData(scenePath);
+    unlink(scenePath);
+    recursion_level = level;
+
+    if (sceneContentHash() != expectedHash) return fail("Scene hash mismatch");
+    if (!sendMessage(fd, MSG_READY, MessageBuffer())) return 1;
+    cout << "Loaded scene, rendering tiles of a " << imageWidth << "x" << imageHeight << " image" << endl;
+
+    int tiles = 0;
+    vector<unsigned char> rgb;
+    while (receiveMessage(fd, type, message) && type == MSG_TILE) {
+        int tile = message.get<int32_t>();
+        TileRect r;
+        r.x0 = message.get<int32_t>(), r.y0 = message.get<int32_t>();
+        r.x1 = message.get<int32_t>(), r.y1 = message.get<int32_t>();
+        if (message.failed || r.x0 < 0 || r.y0 < 0 || r.x1 > imageWidth || r.y1 > imageHeight || r.x0 >= r.x1 || r.y0 >= r.y1) {
+            return fail("Malformed tile request");
+        }
+
+        if (!tracePixelBlock(imageWidth, imageHeight, r.x0, r.y0, r.x1, r.y1, rgb)) return fail(pagedScene.failureReason());
+
+        MessageBuffer reply;
+        reply.put<int32_t>(tile);
+        reply.putBytes(rgb.data(), rgb.size());
+        if (!sendMessage(fd, MSG_TILE_DONE, reply)) break;
+        tiles++;
+    }
+
+    close(fd);
+    cout << "Rendered " << tiles << " tiles" << endl;
+    return 0;
+}
+
+#endif // DISTRIBUTED_H
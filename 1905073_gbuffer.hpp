@@ -0,0 +1,169 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include "1905073_camera.hpp"
+#include "1905073_workers.hpp"
+
+extern int sceneGeometryVersion;
+extern vector<unsigned long long> lightShapes;
+extern vector<Light> lights;
+
+/*
+ * Primary hit of every pixel from the last capture. It stays valid while
+ * the camera, the resolution and the geometry are unchanged. Lights and
+ * materials are read at shading time, so a capture after editing them
+ * starts shading from these hits without tracing primary rays. After
+ * recorded object edits the renderer retraces only the pixels they can
+ * reach and then brings the buffer up to the current geometry.
+ *
+ * Optionally it also keeps which lights each primary hit could see, per
+ * light position and cone. A capture after editing lights recomputes
+ * Lambert and Phong without shadow rays for every light that kept both.
+ */
+class GBuffer {
+    Vector3D pos, l, r, u;
+    int width = 0, height = 0;
+    int geometryVersion = -1;
+    // raw storage, so the pages of each tile are first touched by the worker that traces it
+    struct FreeStorage {
+        void operator()(SurfaceHit* p) { free(p); }
+    };
+    unique_ptr<SurfaceHit[], FreeStorage> hits;
+
+    // per pixel: lightWords words of known bits followed by lightWords words of visible bits
+    vector<unsigned long long> lightBits;
+    int lightWords = 0;
+    // lightShapes entry of the light each column of bits is for
+    vector<unsigned long long> bitShapes;
+
+    static bool same(Vector3D a, Vector3D b) {
+        return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+public:
+    bool matches(Camera& camera, int imageWidth, int imageHeight) {
+        return geometryVersion == sceneGeometryVersion && sameView(camera, imageWidth, imageHeight);
+    }
+
+    // hits are for this view, whatever geometry they were traced against
+    bool sameView(Camera& camera, int imageWidth, int imageHeight) {
+        return geometryVersion >= 0 && width == imageWidth && height == imageHeight &&
+               same(pos, camera.pos) && same(l, camera.l) && same(r, camera.r) && same(u, camera.u);
+    }
+
+    int version() {
+        return geometryVersion;
+    }
+
+    // the stale hits have been retraced against the current geometry
+    void updateVersion() {
+        geometryVersion = sceneGeometryVersion;
+    }
+
+    // toucher, when given, initialises the hits split into tileSize tiles exactly as the
+    // render that fills them, so each node first touches the share of tiles its workers
+    // will trace; a page straddling two shares goes to whichever node touches it first
+    void reset(Camera& camera, int imageWidth, int imageHeight, WorkerPool* toucher = nullptr, int tileSize = 0) {
+        pos = camera.pos;
+        l = camera.l;
+        r = camera.r;
+        u = camera.u;
+        width = imageWidth;
+        height = imageHeight;
+        geometryVersion = sceneGeometryVersion;
+        hits.reset((SurfaceHit*)malloc(sizeof(SurfaceHit) * width * height));
+
+        if (toucher) {
+            int tilesX = (width + tileSize - 1) / tileSize;
+            int tilesY = (height + tileSize - 1) / tileSize;
+            toucher->run(tilesX * tilesY, [&](int tile, int worker) {
+                int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+                int x1 = min(x0 + tileSize, width), y1 = min(y0 + tileSize, height);
+                for (int j = y0; j < y1; j++) {
+                    for (int i = x0; i < x1; i++) new (&hits[j * width + i]) SurfaceHit();
+                }
+            });
+        } else {
+            for (int k = 0; k < width * height; k++) new (&hits[k]) SurfaceHit();
+        }
+        lightBits.clear();
+    }
+
+    bool hasLightVisibility() {
+        return !lightBits.empty();
+    }
+
+    void resetLightVisibility() {
+        lightWords = (lights.size() + 63) / 64;
+        bitShapes = lightShapes;
+        lightBits.assign((size_t)width * height * lightWords * 2, 0);
+    }
+
+    // Moves the bits of every light whose position and cone are unchanged to
+    // its current id and forgets the rest; only usable on top of matching
+    // hits. Returns how many lights kept their bits.
+    int carryLightVisibility() {
+        // old ids by shape, lowest last, so equal lights keep their order
+        map<unsigned long long, vector<int>> oldIds;
+        for (int o = (int)bitShapes.size() - 1; o >= 0; o--) oldIds[bitShapes[o]].push_back(o);
+
+        vector<int> from(lightShapes.size(), -1);
+        int kept = 0;
+        bool sameIds = lightShapes.size() == bitShapes.size();
+        for (size_t n = 0; n < lightShapes.size(); n++) {
+            auto it = oldIds.find(lightShapes[n]);
+            if (it == oldIds.end() || it->second.empty()) continue;
+            from[n] = it->second.back();
+            it->second.pop_back();
+            kept++;
+            if (from[n] != (int)n) sameIds = false;
+        }
+        if (kept == (int)lightShapes.size() && sameIds) return kept;
+
+        size_t pixelCount = (size_t)width * height;
+        if (sameIds) {
+            // lights only moved: clear the known bits of the moved ones in place
+            vector<unsigned long long> moved(lightWords, 0);
+            for (size_t n = 0; n < from.size(); n++) {
+                if (from[n] < 0) moved[n / 64] |= 1ULL << (n % 64);
+            }
+            for (size_t p = 0; p < pixelCount; p++) {
+                for (int w = 0; w < lightWords; w++) lightBits[p * lightWords * 2 + w] &= ~moved[w];
+            }
+        } else {
+            int words = (lightShapes.size() + 63) / 64;
+            vector<unsigned long long> bits(pixelCount * words * 2, 0);
+            for (size_t p = 0; p < pixelCount; p++) {
+                unsigned long long* old = &lightBits[p * lightWords * 2];
+                unsigned long long* fresh = &bits[p * words * 2];
+                for (size_t n = 0; n < from.size(); n++) {
+                    int o = from[n];
+                    if (o < 0 || !(old[o / 64] >> (o % 64) & 1)) continue;
+                    fresh[n / 64] |= 1ULL << (n % 64);
+                    fresh[words + n / 64] |= (old[lightWords + o / 64] >> (o % 64) & 1) << (n % 64);
+                }
+            }
+            lightBits.swap(bits);
+            lightWords = words;
+        }
+        bitShapes = lightShapes;
+        return kept;
+    }
+
+    LightVisibility visibilityAt(int i, int j) {
+        LightVisibility v;
+        v.known = &lightBits[((size_t)j * width + i) * lightWords * 2];
+        v.visible = v.known + lightWords;
+        return v;
+    }
+
+    void invalidate() {
+        geometryVersion = -1;
+    }
+
+    SurfaceHit& at(int i, int j) {
+        return hits[j * width + i];
+    }
+};
+
+#endif // GBUFFER_H
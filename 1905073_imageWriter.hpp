@@ -0,0 +1,135 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+#include "bitmap_image.hpp"
+
+using namespace std;
+
+struct ImageWrite {
+    bitmap_image image;
+    string path;
+    // runs on the writer thread once the file is safely on disk
+    function<void()> onWritten;
+};
+
+/*
+ * Background BMP writer. Finished framebuffers are queued and written by a
+ * single thread, so tracing the next image overlaps with writing and
+ * flushing the previous one. The queue is bounded: submit() blocks while it
+ * is full, which keeps memory at capacity images however slow the disk is.
+ *
+ * Every file is written under a temporary name and renamed into place only
+ * after its size has been checked, so a failed write never leaves a
+ * truncated image behind. Failures are collected for the caller, see
+ * takeErrors() and flush().
+ */
+class ImageWriter {
+    int capacity;
+    deque<ImageWrite> queue;
+    vector<string> errors;
+    bool writing = false;
+    bool stopping = false;
+
+    mutex lock;
+    condition_variable changed;
+    thread worker;
+
+    // size save_image produces: headers plus rows padded to 4 bytes
+    static uintmax_t expectedSize(bitmap_image& image) {
+        uintmax_t row = (image.width() * 3 + 3) & ~3u;
+        return 54 + row * image.height();
+    }
+
+    string write(ImageWrite& job) {
+        error_code ec;
+        string temporary = job.path + ".part";
+
+        job.image.save_image(temporary);
+        uintmax_t size = filesystem::file_size(temporary, ec);
+        if (ec || size != expectedSize(job.image)) {
+            filesystem::remove(temporary, ec);
+            return "Could not write " + job.path;
+        }
+
+        filesystem::rename(temporary, job.path, ec);
+        if (ec) {
+            string error = "Could not write " + job.path + ": " + ec.message();
+            filesystem::remove(temporary, ec);
+            return error;
+        }
+
+        if (job.onWritten) job.onWritten();
+        return "";
+    }
+
+    void run() {
+        while (true) {
+            ImageWrite job;
+            {
+                unique_lock<mutex> guard(lock);
+                changed.wait(guard, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+
+                job = move(queue.front());
+                queue.pop_front();
+                writing = true;
+            }
+            changed.notify_all();
+
+            string error = write(job);
+
+            {
+                lock_guard<mutex> guard(lock);
+                if (!error.empty()) errors.push_back(error);
+                writing = false;
+            }
+            changed.notify_all();
+        }
+    }
+
+public:
+    ImageWriter(int capacity) : capacity(max(capacity, 1)), worker(&ImageWriter::run, this) {}
+
+    // drains the queue before stopping
+    ~ImageWriter() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    // queues image for path, waiting while the queue is full
+    void submit(bitmap_image image, string path, function<void()> onWritten = nullptr) {
+        unique_lock<mutex> guard(lock);
+        changed.wait(guard, [&] { return (int)queue.size() < capacity; });
+        queue.push_back({move(image), path, onWritten});
+        guard.unlock();
+        changed.notify_all();
+    }
+
+    // failures since the last call, oldest first
+    vector<string> takeErrors() {
+        lock_guard<mutex> guard(lock);
+        vector<string> taken;
+        taken.swap(errors);
+        return taken;
+    }
+
+    // waits until every queued image is written, then returns the failures
+    vector<string> flush() {
+        {
+            unique_lock<mutex> guard(lock);
+            changed.wait(guard, [&] { return queue.empty() && !writing; });
+        }
+        return takeErrors();
+    }
+};
+
+#endif // IMAGEWRITER_H
@@ -0,0 +1,160 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include "1905073_classes.hpp"
+
+// Per-thread random stream. Callers reseed it per pixel, so a sample never
+// depends on which thread traced the pixel or in what order.
+thread_local unsigned long long randomState = 0;
+
+inline unsigned long long mixBits(unsigned long long x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+inline unsigned long long hashCombine(unsigned long long h, double v) {
+    unsigned long long bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return mixBits(h ^ (bits + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+inline void seedRandom(unsigned long long seed) {
+    randomState = mixBits(seed + 0x9e3779b97f4a7c15ULL);
+}
+
+// uniform in [0, 1)
+inline double nextRandom() {
+    randomState += 0x9e3779b97f4a7c15ULL;
+    return (mixBits(randomState) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+struct LightTreeNode {
+    Vector3D lo, hi;
+    double power;
+    int left, right;
+    // light id for leaves, -1 for inner nodes
+    int light;
+};
+
+/*
+ * Binary hierarchy over the render lights, bounded by position and summed
+ * power. Sampling walks from the root and picks each child in proportion
+ * to a cheap estimate of how much it can contribute to the shading point,
+ * so a fixed number of samples covers any number of lights.
+ */
+class LightTree {
+    vector<LightTreeNode> nodes;
+    vector<RenderLight*> leaves;
+
+    int build(vector<int>& order, int begin, int end) {
+        LightTreeNode node;
+        node.lo = Vector3D(INF, INF, INF);
+        node.hi = Vector3D(-INF, -INF, -INF);
+        node.power = 0;
+        node.left = node.right = node.light = -1;
+
+        for (int i = begin; i < end; i++) {
+            RenderLight* l = leaves[order[i]];
+            node.lo = Vector3D(min(node.lo.x, l->pos.x), min(node.lo.y, l->pos.y), min(node.lo.z, l->pos.z));
+            node.hi = Vector3D(max(node.hi.x, l->pos.x), max(node.hi.y, l->pos.y), max(node.hi.z, l->pos.z));
+            node.power += l->color.getR() + l->color.getG() + l->color.getB();
+        }
+
+        int index = nodes.size();
+        nodes.push_back(node);
+
+        if (end - begin == 1) {
+            nodes[index].light = leaves[order[begin]]->id;
+            return index;
+        }
+
+        // median split along the longest axis of the bounds
+        Vector3D extent = node.hi - node.lo;
+        int axis = (extent.x >= extent.y && extent.x >= extent.z) ? 0 : (extent.y >= extent.z) ? 1 : 2;
+        auto coordinate = [&](int i) {
+            Vector3D p = leaves[i]->pos;
+            return (axis == 0) ? p.x : (axis == 1) ? p.y : p.z;
+        };
+
+        int mid = (begin + end) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                    [&](int a, int b) { return coordinate(a) < coordinate(b); });
+
+        int left = build(order, begin, mid);
+        int right = build(order, mid, end);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        return index;
+    }
+
+    // power over squared distance, scaled by the best cosine any point of the bounds can reach
+    double importance(LightTreeNode& node, Vector3D& point, Vector3D& normal) {
+        Vector3D center = (node.lo + node.hi) * 0.5;
+        Vector3D diagonal = node.hi - node.lo;
+        Vector3D toCenter = center - point;
+        double d2 = max(toCenter.dot(toCenter), diagonal.dot(diagonal) * 0.25);
+
+        bool inside = point.x >= node.lo.x && point.x <= node.hi.x &&
+                      point.y >= node.lo.y && point.y <= node.hi.y &&
+                      point.z >= node.lo.z && point.z <= node.hi.z;
+
+        double cosBound = inside ? 1.0 : 0.0;
+        for (int c = 0; c < 8 && cosBound < 1.0; c++) {
+            Vector3D corner((c & 1) ? node.hi.x : node.lo.x,
+                            (c & 2) ? node.hi.y : node.lo.y,
+                            (c & 4) ? node.hi.z : node.lo.z);
+            Vector3D dir = corner - point;
+            double length = sqrt(dir.dot(dir));
+            if (length > 0) cosBound = max(cosBound, normal.dot(dir) / length);
+        }
+
+        return node.power * cosBound / max(d2, EPSILON);
+    }
+
+public:
+    void build(vector<RenderLight>& pointLights, vector<RenderLight>& spotLights) {
+        nodes.clear();
+        leaves.clear();
+        for (RenderLight& l : pointLights) leaves.push_back(&l);
+        for (RenderLight& l : spotLights) leaves.push_back(&l);
+        if (leaves.empty()) return;
+
+        vector<int> order(leaves.size());
+        iota(order.begin(), order.end(), 0);
+        build(order, 0, order.size());
+    }
+
+    // Picks one light id by importance using the uniform number u and sets its
+    // probability in pdf; -1 when nothing can light the point.
+    int sample(Vector3D& point, Vector3D& normal, double u, double& pdf) {
+        pdf = 1.0;
+        if (nodes.empty()) return -1;
+
+        int current = 0;
+        while (nodes[current].light == -1) {
+            LightTreeNode& node = nodes[current];
+            double left = importance(nodes[node.left], point, normal);
+            double right = importance(nodes[node.right], point, normal);
+            if (left + right <= 0) return -1;
+
+            double pLeft = left / (left + right);
+            if (u < pLeft) {
+                current = node.left;
+                pdf *= pLeft;
+                u = u / pLeft;
+            } else {
+                current = node.right;
+                pdf *= 1.0 - pLeft;
+                u = (u - pLeft) / (1.0 - pLeft);
+            }
+        }
+
+        return nodes[current].light;
+    }
+};
+
+#endif // LIGHTTREE_H
@@ -1,12 +1,19 @@
-#include "bitmap_image.hpp"
-#include "1905073_scene.hpp"
+#include "1905073_renderer.hpp"
+#include "1905073_renderCache.hpp"
+#include "1905073_animation.hpp"
+#include "1905073_distributed.hpp"
+#include "1905073_server.hpp"
+#include "1905073_selfCheck.hpp"
+#include "1905073_console.hpp"
 
 using namespace std;
 
-int windowWidth = 500;
-int windowHeight = 500;
 int captureCount  = 11;
-double viewAngle = 80;
+bool renderCacheEnabled = false;
+RenderCache renderCache("render_cache", 512ULL << 20);
+// declared after renderCache: queued writes may still add to the cache while it drains at exit
+ImageWriter imageWriter(2);
+CommandConsole console;
 
 void drawObjects()
 {
@@ -15,84 +22,77 @@ void drawObjects()
     }
 }
 
-void setDefaultBackgroundColor(bitmap_image& image, int imageWidth, int imageHeight) {
-    for (int i = 0; i < imageWidth; i++) {
-        for (int j = 0; j < imageHeight; j++) {
-            image.set_pixel(i, j, 0, 0, 0);
-        }
-    }
-}
-
-Vector3D calculateTopLeft(Camera& camera, double windowWidth, double windowHeight) {
-    Vector3D temp = camera.pos + camera.l * (windowHeight * 0.5) / tan((viewAngle * 0.5) * (PI / 180));
-    temp = temp - camera.r * (windowWidth / 2.0);
-    return temp + camera.u * (windowHeight / 2.0);
-}
-
-void calculatePixelParameters(Camera& camera, int imageWidth, int imageHeight, double du, double dv, Vector3D& topLeft) {
-    Vector3D temp = camera.r * (du / 2.0) - camera.u * (dv / 2.0);
-    topLeft = topLeft + temp;
-}
-
-Ray calculateRay(Camera& camera, Vector3D& topLeft, double du, double dv, int i, int j) {
-    Vector3D curPixel = topLeft + camera.r * (du * i) - camera.u * (dv * j);
-    return Ray(camera.pos, (curPixel - camera.pos));
-}
-
-int findNearestObject(Ray& ray, Color& color, vector<Object*>& objects) {
-    int nearest = -1;
-    double tMin = INFINITY;
-
-    for (int k = 0; k < objects.size(); k++) {
-        double t = objects[k]->intersectWithIllumination(ray, color, 0);
-        if (t < tMin && t > 0) {
-            nearest = k;
-            tMin = t;
-        }
-    }
-    return nearest;
+// surfaces background write failures of earlier captures
+void reportWriteErrors() {
+    for (string& error : imageWriter.takeErrors()) cerr << error << endl;
 }
 
 void capture() {
+    reportWriteErrors();
     cout << "Capturing bitmap image " << pixels << endl;
 
     int imageWidth = pixels;
     int imageHeight = pixels;
 
+    unsigned long long key = 0;
+    if (renderCacheEnabled) {
+        key = renderKey(camera, imageWidth, imageHeight);
+        string outPath = "output_" + to_string(captureCount) + ".bmp";
+        if (renderCache.fetch(key, outPath)) {
+            // the cached image left no hits behind; nothing may build on the frame traced before it
+            gbuffer.invalidate();
+            history.invalidate();
+            captureCount++;
+            cout << "Finished Capturing bitmap image from the render cache. Path: " << outPath << endl;
+            return;
+        }
+    }
+
     bitmap_image image(pixels, pixels);
-    setDefaultBackgroundColor(image, imageWidth, imageHeight);
+    if (!renderImage(image, imageWidth, imageHeight)) {
+        cerr << "Capture abandoned: " << pagedScene.failureReason() << endl;
+        return;
+    }
 
-    double planeDistance = (windowHeight * 0.5) / tan((viewAngle * 0.5) * (PI / 180));
-    Vector3D topLeft = calculateTopLeft(camera, windowWidth, windowHeight);
+    string outPath = "output_" + to_string(captureCount) + ".bmp";
+    captureCount++;
 
-    double du = (double)windowWidth / imageWidth;
-    double dv = (double)windowHeight / imageHeight;
+    function<void()> addToCache = nullptr;
+    if (renderCacheEnabled) addToCache = [key, outPath] { renderCache.store(key, outPath); };
+    imageWriter.submit(image, outPath, addToCache);
 
-    calculatePixelParameters(camera, imageWidth, imageHeight, du, dv, topLeft);
+    cout << "Finished Capturing bitmap image. Path: " << outPath << endl;
+    if (pagedMode) cout << pagedScene.report() << endl;
+}
 
-    for (int i = 0; i < imageWidth; i++) {
-        for (int j = 0; j < imageHeight; j++) {
-            Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
-            Color color;
+// Preview-quality capture: reuses the previous frame's pixels through
+// reprojection and retraces only what it cannot trust.
+void capturePreview() {
+    int imageWidth = pixels;
+    int imageHeight = pixels;
 
-            int nearest = findNearestObject(ray, color, objects);
+    if (!history.usable(imageWidth, imageHeight)) {
+        cout << "No previous frame to reproject, capturing in full" << endl;
+        capture();
+        return;
+    }
 
-            if (nearest != -1) {
-                double tNear = objects[nearest]->intersectWithIllumination(ray, color, 1);
-            }
+    reportWriteErrors();
+    cout << "Capturing preview bitmap image " << pixels << endl;
 
-            color.fix();
-            image.set_pixel(i, j, (color.getR() * 255), (color.getG() * 255), (color.getB()) * 255);
-        }
+    bitmap_image image(pixels, pixels);
+    int retraced = renderPreview(image, imageWidth, imageHeight);
+    if (retraced < 0) {
+        cerr << "Preview abandoned: " << pagedScene.failureReason() << endl;
+        return;
     }
 
-    string outPath = "output_" + to_string(captureCount) + ".bmp";
+    string outPath = "output_" + to_string(captureCount) + "_preview.bmp";
     captureCount++;
 
-    image.save_image(outPath);
-    image.clear();
+    imageWriter.submit(image, outPath);
 
-    cout << "Finished Capturing bitmap image. Path: " << outPath << endl;
+    cout << "Finished preview (" << retraced << " of " << imageWidth * imageHeight << " pixels retraced). Path: " << outPath << endl;
 }
 
 void drawLights()
@@ -111,6 +111,29 @@ void handlelengthalKey(unsigned char key, Camera &camera) {
         case '0':
             capture();
             break;
+        case 'p':
+            capturePreview();
+            break;
+        case 'a':
+            antialiasing = !antialiasing;
+            cout << "Adaptive antialiasing " << (antialiasing ? "on" : "off") << endl;
+            break;
+        case 'c':
+            renderCacheEnabled = !renderCacheEnabled;
+            cout << "Render cache " << (renderCacheEnabled ? "on" : "off") << endl;
+            break;
+        case 'w':
+            wavefrontMode = !wavefrontMode;
+            cout << "Wavefront rendering " << (wavefrontMode ? "on" : "off") << endl;
+            break;
+        case 'v':
+            lightVisibilityCache = !lightVisibilityCache;
+            cout << "Light visibility cache " << (lightVisibilityCache ? "on" : "off") << endl;
+            break;
+        case 'm':
+            manyLightMode = !manyLightMode;
+            cout << "Many-light sampling " << (manyLightMode ? "on" : "off") << " (" << lightSampleBudget << " lights per hit)" << endl;
+            break;
         // Rotation
         case '1':
             camera.rotateLeft(rotationAngle);
@@ -199,7 +222,16 @@ void display(){
     glutSwapBuffers();
 }
 
+// console commands beyond scene edits
+bool appCommand(string command) {
+    if (command == "capture") capture();
+    else if (command == "preview") capturePreview();
+    else return false;
+    return true;
+}
+
 void animate() {
+    for (string& line : console.take()) runSceneCommand(line, appCommand);
 	glutPostRedisplay();
 }
 
@@ -214,13 +246,117 @@ void init() {
 }
 
 void clearMemory() {
-    objects.clear();
-    lights.clear();
+    freeNodeScenes(workers);
+    unloadScene();
 }
 
 
 int main(int argc, char **argv){
 
+    // placement options go before the mode:
+    //     --numa            pin one render thread per CPU, node by node
+    //     --numa-replicate  also keep a copy of the scene on every NUMA node
+    //     --paged <page file> <cache MiB>   trace a scene written by --page-scene
+    //                       instead of scene.txt, with at most that much of it loaded
+    //     --reflection-threshold <weight>   stop reflections whose accumulated kr
+    //                       falls below weight (default 1/255; 0 traces to recursion_level)
+    bool pinWorkers = false;
+    while (argc >= 2) {
+        string option = argv[1];
+        int used = 1;
+        if (option == "--numa" || option == "--numa-replicate") {
+            pinWorkers = true;
+            if (option == "--numa-replicate") numaReplication = true;
+        } else if (option == "--paged" && argc >= 4) {
+            pagedScenePath = argv[2];
+            pageCacheBytes = (size_t)(atof(argv[3]) * (1 << 20));
+            used = 3;
+        } else if (option == "--reflection-threshold" && argc >= 3) {
+            reflection_threshold = atof(argv[2]);
+            used = 2;
+        } else {
+            break;
+        }
+        argv[used] = argv[0];
+        argv += used;
+        argc -= used;
+    }
+    if (pinWorkers) pinWorkersToNodes(workers);
+
+    // out-of-core scenes: write scene.txt as a page file and exit
+    //     --page-scene <page file> [objects per page]
+    if (argc >= 3 && string(argv[1]) == "--page-scene") {
+        int perPage = (argc >= 4) ? atoi(argv[3]) : PAGE_OBJECTS;
+        if (perPage < 1) {
+            cerr << "A page holds at least one object" << endl;
+            return 1;
+        }
+        if (!pagedScenePath.empty()) {
+            cerr << "--page-scene reads scene.txt, not a page file" << endl;
+            return 1;
+        }
+        loadData();
+        bool written = writePagedScene(argv[2], perPage);
+        clearMemory();
+        return written ? 0 : 1;
+    }
+
+    // headless: render a camera path and exit, optionally as a video stream
+    //     --animate <path> [--stream y4m|rgb <file, fifo or - for stdout>]
+    if (argc >= 3 && string(argv[1]) == "--animate") {
+        int status;
+        if (argc >= 6 && string(argv[3]) == "--stream") status = renderAnimation(argv[2], imageWriter, argv[4], argv[5]);
+        else status = renderAnimation(argv[2], imageWriter);
+        clearMemory();
+        return status;
+    }
+
+    // distributed rendering: one coordinator renders the default view with tiles traced by the workers
+    //     --coordinate <port> <worker count>      --worker <coordinator host> <port>
+    if (argc >= 4 && string(argv[1]) == "--coordinate") {
+        loadData();
+        camera = Camera();
+        bitmap_image image(pixels, pixels);
+        if (!renderDistributed(atoi(argv[2]), atoi(argv[3]), "scene.txt", image, pixels, pixels)) return 1;
+
+        string outPath = "output_" + to_string(captureCount) + ".bmp";
+        imageWriter.submit(image, outPath);
+        vector<string> errors = imageWriter.flush();
+        for (string& error : errors) cerr << error << endl;
+        cout << "Finished distributed capture. Path: " << outPath << endl;
+        clearMemory();
+        return errors.empty() ? 0 : 1;
+    }
+    if (argc >= 4 && string(argv[1]) == "--worker") {
+        int status = runTileWorker(argv[2], atoi(argv[3]));
+        clearMemory();
+        return status;
+    }
+
+    // self-check: every render path gives the same bytes for any thread count
+    if (argc >= 2 && string(argv[1]) == "--verify-determinism") {
+        int status = verifyDeterminism();
+        clearMemory();
+        return status;
+    }
+
+    // render daemon: keep the scene loaded and answer requests on a Unix socket
+    //     --serve <socket path> [output directory]
+    // without an output directory, images are only sent back over the socket
+    if (argc >= 3 && string(argv[1]) == "--serve") {
+        loadData();
+        RenderServer server(argv[2], argc >= 4 ? argv[3] : "");
+        if (!server.start()) return 1;
+        server.serve();
+        clearMemory();
+        return 0;
+    }
+
+    // interactive: scene edits are read from stdin and, with --commands, first from a file
+    //     [--commands <command file>]
+    string commandFile;
+    if (argc >= 3 && string(argv[1]) == "--commands") commandFile = argv[2];
+
     glutInit(&argc,argv);
     glutInitWindowSize(windowWidth, windowHeight);
     glutInitWindowPosition(0, 0);
@@ -230,6 +366,8 @@ int main(int argc, char **argv){
 
     loadData();
     init();
+    if (!commandFile.empty()) runCommandFile(commandFile, appCommand);
+    console.start();
 
     glEnable(GL_DEPTH_TEST);
 
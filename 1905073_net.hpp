@@ -0,0 +1,218 @@
+#ifndef NET_H
+#define NET_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// larger messages are treated as a broken peer
+#define MAX_MESSAGE_BYTES (256u << 20)
+
+/*
+ * Payload of one message. Values are appended and read back in the same
+ * order as raw host-order bytes, so both ends must share an architecture;
+ * reading past the end sets failed instead of throwing.
+ */
+class MessageBuffer {
+    size_t readPos = 0;
+
+public:
+    vector<unsigned char> bytes;
+    bool failed = false;
+
+    void clear() {
+        bytes.clear();
+        readPos = 0;
+        failed = false;
+    }
+
+    template <typename T>
+    void put(T value) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(&value);
+        bytes.insert(bytes.end(), p, p + sizeof(T));
+    }
+
+    void putBytes(const void* data, size_t length) {
+        put<uint32_t>(length);
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        bytes.insert(bytes.end(), p, p + length);
+    }
+
+    void putString(const string& s) {
+        putBytes(s.data(), s.size());
+    }
+
+    template <typename T>
+    T get() {
+        T value{};
+        if (failed || readPos + sizeof(T) > bytes.size()) {
+            failed = true;
+            return value;
+        }
+        memcpy(&value, &bytes[readPos], sizeof(T));
+        readPos += sizeof(T);
+        return value;
+    }
+
+    vector<unsigned char> getBytes() {
+        uint32_t length = get<uint32_t>();
+        if (failed || readPos + length > bytes.size()) {
+            failed = true;
+            return {};
+        }
+        vector<unsigned char> data(bytes.begin() + readPos, bytes.begin() + readPos + length);
+        readPos += length;
+        return data;
+    }
+
+    string getString() {
+        vector<unsigned char> data = getBytes();
+        return string(data.begin(), data.end());
+    }
+};
+
+inline bool sendAll(int fd, const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t sent = send(fd, p, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        p += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+inline bool receiveAll(int fd, void* data, size_t length) {
+    char* p = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t received = recv(fd, p, length, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        p += received;
+        length -= received;
+    }
+    return true;
+}
+
+// a message is a type and a payload length (both uint32) followed by the payload
+inline bool sendMessage(int fd, uint32_t type, const MessageBuffer& payload) {
+    uint32_t header[2] = {type, (uint32_t)payload.bytes.size()};
+    return sendAll(fd, header, sizeof(header)) && sendAll(fd, payload.bytes.data(), payload.bytes.size());
+}
+
+inline bool receiveMessage(int fd, uint32_t& type, MessageBuffer& payload) {
+    uint32_t header[2];
+    if (!receiveAll(fd, header, sizeof(header)) || header[1] > MAX_MESSAGE_BYTES) return false;
+
+    type = header[0];
+    payload.clear();
+    payload.bytes.resize(header[1]);
+    return receiveAll(fd, payload.bytes.data(), header[1]);
+}
+
+/*
+ * Reassembles messages from a socket without blocking, for loops that poll
+ * many peers: receive() takes whatever bytes have arrived and next() hands
+ * out each message once all of it is in. A peer that stops halfway leaves
+ * waiting() true, so the caller can time it out instead of hanging in
+ * receiveMessage().
+ */
+class MessageReader {
+    vector<unsigned char> data;
+
+public:
+    // set once a header announces more than MAX_MESSAGE_BYTES
+    bool oversized = false;
+
+    // false when the peer has closed the connection or it failed
+    bool receive(int fd) {
+        unsigned char chunk[1 << 16];
+        while (true) {
+            ssize_t received = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+            if (received > 0) {
+                data.insert(data.end(), chunk, chunk + received);
+                return true;
+            }
+            if (received < 0 && errno == EINTR) continue;
+            return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    // the next whole message, false if it has not all arrived
+    bool next(uint32_t& type, MessageBuffer& payload) {
+        uint32_t header[2];
+        if (data.size() < sizeof(header)) return false;
+        memcpy(header, data.data(), sizeof(header));
+        if (header[1] > MAX_MESSAGE_BYTES) {
+            oversized = true;
+            return false;
+        }
+        if (data.size() < sizeof(header) + header[1]) return false;
+
+        type = header[0];
+        payload.clear();
+        payload.bytes.assign(data.begin() + sizeof(header), data.begin() + sizeof(header) + header[1]);
+        data.erase(data.begin(), data.begin() + sizeof(header) + header[1]);
+        return true;
+    }
+
+    // part of a message has arrived
+    bool waiting() {
+        return !data.empty();
+    }
+};
+
+// listening TCP socket on every interface, -1 on failure
+inline int listenTcp(int port, int backlog = 64) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr*)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+inline int connectTcp(const string& host, int port) {
+    addrinfo hints = {}, *results = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), to_string(port).c_str(), &hints, &results) != 0) return -1;
+
+    int fd = -1;
+    for (addrinfo* a = results; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+
+    // tiles are small request/response pairs; do not let Nagle hold them back
+    int on = 1;
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+#endif // NET_H
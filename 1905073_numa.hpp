@@ -0,0 +1,135 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include "1905073_workers.hpp"
+#include "1905073_rayTracing.hpp"
+
+extern vector<Object*> objects;
+extern int sceneGeometryVersion;
+unsigned long long sceneContentHash();
+
+// "0-3,8,10-11" as in /sys/devices/system/node/node*/cpulist
+vector<int> parseCpuList(string list) {
+    vector<int> cpus;
+    stringstream input(list);
+    string range;
+    while (getline(input, range, ',')) {
+        int first, last;
+        if (sscanf(range.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        } else if (sscanf(range.c_str(), "%d", &first) == 1) {
+            cpus.push_back(first);
+        }
+    }
+    return cpus;
+}
+
+// CPUs of every NUMA node, limited to those this process may run on; one node
+// holding every allowed CPU when the kernel does not report a topology
+vector<vector<int>> numaNodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    vector<vector<int>> nodes;
+    for (int node = 0; ; node++) {
+        ifstream list("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        if (!list) break;
+
+        string text;
+        getline(list, text);
+        vector<int> cpus;
+        for (int cpu : parseCpuList(text)) {
+            if (CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+        }
+        if (!cpus.empty()) nodes.push_back(cpus);
+    }
+
+    if (nodes.empty()) {
+        nodes.push_back({});
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) nodes[0].push_back(cpu);
+        }
+    }
+    return nodes;
+}
+
+/*
+ * NUMA placement for the render workers. pinWorkersToNodes() starts one
+ * pinned worker per usable CPU, node by node, so a pinned pool traces each
+ * node's share of the tiles on that node; the G-buffer tiles are first
+ * touched there as well (see GBuffer::reset).
+ *
+ * With numaReplication the objects and sceneBvh are also copied once per
+ * node, by a worker of that node so the copies live in its memory, and each
+ * worker traces against its node's copies instead of the ones the main
+ * thread allocated. Any change to the objects or the hierarchy (a refit, an
+ * edit, a reload) makes the next render copy them again.
+ */
+bool numaReplication = false;
+vector<int> workerNode;
+vector<vector<Object*>> nodeScenes;
+vector<unique_ptr<SceneArena>> nodeArenas;
+vector<unique_ptr<ObjectBvh>> nodeTrees;
+unsigned long long replicatedScene = 0;
+int replicatedGeometry = -1;
+
+void pinWorkersToNodes(WorkerPool& pool) {
+    vector<vector<int>> nodes = numaNodes();
+    vector<int> cpus;
+    workerNode.clear();
+    for (int node = 0; node < (int)nodes.size(); node++) {
+        for (int cpu : nodes[node]) {
+            cpus.push_back(cpu);
+            workerNode.push_back(node);
+        }
+    }
+
+    pool.pin(cpus, workerNode);
+    cout << "Pinned " << cpus.size() << " render threads over " << nodes.size() << " NUMA node(s)" << endl;
+}
+
+void freeNodeScenes(WorkerPool& pool) {
+    if (nodeScenes.empty()) return;
+
+    if (pool.pinned()) {
+        pool.runOnEach([](int worker) {
+            traceObjects = nullptr;
+            traceBvh = nullptr;
+        });
+    }
+    nodeScenes.clear();
+    nodeArenas.clear();
+    nodeTrees.clear();
+}
+
+// rebuilds the per-node copies when the scene changed since they were made
+void refreshNodeScenes(WorkerPool& pool) {
+    if (!numaReplication || !pool.pinned() || (int)workerNode.size() != pool.size()) return;
+
+    unsigned long long current = sceneContentHash();
+    if (!nodeScenes.empty() && replicatedScene == current && replicatedGeometry == sceneGeometryVersion) return;
+
+    freeNodeScenes(pool);
+    int nodeCount = *max_element(workerNode.begin(), workerNode.end()) + 1;
+    nodeScenes.assign(nodeCount, {});
+    nodeTrees.resize(nodeCount);
+    for (int node = 0; node < nodeCount; node++) nodeArenas.push_back(make_unique<SceneArena>());
+
+    // the first worker of each node makes its copies
+    pool.runOnEach([&](int worker) {
+        int node = workerNode[worker];
+        if (worker > 0 && workerNode[worker - 1] == node) return;
+        for (Object* o : objects) nodeScenes[node].push_back(o->clone(*nodeArenas[node]));
+        nodeTrees[node] = make_unique<ObjectBvh>(sceneBvh);
+    });
+    pool.runOnEach([&](int worker) {
+        traceObjects = &nodeScenes[workerNode[worker]];
+        traceBvh = nodeTrees[workerNode[worker]].get();
+    });
+
+    replicatedScene = current;
+    replicatedGeometry = sceneGeometryVersion;
+}
+
+#endif // NUMA_H
@@ -0,0 +1,588 @@
+#ifndef PAGEDSCENE_H
+#define PAGEDSCENE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "1905073_rayTracing.hpp"
+
+extern int pixels, sceneGeometryVersion;
+extern SceneArena sceneArena;
+void compileLights();
+void unloadScene();
+unsigned long long sceneContentHash();
+
+#define PAGE_FILE_MAGIC "RTPAGES"
+#define PAGE_FILE_VERSION 1
+// bounded objects per page when --page-scene is not given a count
+#define PAGE_OBJECTS 256
+// pages each thread keeps loaded for the last objects objectAt() gave it
+#define PAGE_HOLDS 4
+// pages each thread looks up last, found again without taking the cache's lock
+#define PAGE_RECENT 8
+
+/*
+ * A page file holds, in this order: the header, the lights, the records of
+ * the resident objects, the page table and then the records of every page.
+ * Records are written as they are in memory, so a page file is only read
+ * back on the kind of machine that wrote it.
+ */
+struct PageFileHeader {
+    char magic[8];
+    int32_t version, recursionLevel, pixels, objectsPerPage;
+    int64_t pagedObjects, pageCount, residentObjects, lightCount;
+    // sceneContentHash() of the scene the file was made from
+    uint64_t contentHash;
+};
+
+struct LightRecord {
+    double position[3], color[3], direction[3], cutoff;
+    int32_t spot, unused;
+};
+
+struct PageEntry {
+    int64_t offset;
+    int32_t count, unused;
+    // box around the page's objects
+    double lo[3], hi[3];
+};
+
+bool pagedMode = false;
+// page file loadData() reads instead of scene.txt when set, and its cache size
+string pagedScenePath;
+size_t pageCacheBytes = 64 << 20;
+unsigned long long pagedContentHash = 0;
+
+// one page of a paged scene while it is loaded
+struct ScenePage {
+    SceneArena arena;
+    vector<Object*> objects;
+    ObjectBvh bvh;
+    size_t bytes = 0;
+    // bytes of every page still alive, wherever it is held; this one leaves it when freed
+    shared_ptr<atomic<size_t>> live;
+
+    ~ScenePage() {
+        if (live) *live -= bytes;
+    }
+};
+
+/*
+ * Writes the loaded scene as a page file. arrangeObjects() put the bounded
+ * objects first and in Morton order, so each run of perPage of them is
+ * compact in space and becomes one page; the unbounded objects, the lights
+ * and the scene parameters stay resident. Objects keep the indices they
+ * have in the loaded scene. Returns false if the file cannot be written.
+ */
+bool writePagedScene(string path, int perPage) {
+    int paged = 0;
+    Vector3D lo, hi;
+    while (paged < (int)objects.size() && objects[paged]->bounds(lo, hi)) paged++;
+    int pageCount = (paged + perPage - 1) / perPage;
+
+    PageFileHeader header = {};
+    memcpy(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic));
+    header.version = PAGE_FILE_VERSION;
+    header.recursionLevel = recursion_level;
+    header.pixels = pixels;
+    header.objectsPerPage = perPage;
+    header.pagedObjects = paged;
+    header.pageCount = pageCount;
+    header.residentObjects = objects.size() - paged;
+    header.lightCount = lights.size();
+    header.contentHash = sceneContentHash();
+
+    vector<LightRecord> lightRecords;
+    for (Light& l : lights) {
+        Vector3D pos = l.getLightPos(), dir = l.getSpotDirection();
+        Color c = l.getColor();
+        LightRecord r = {{pos.x, pos.y, pos.z}, {c.getR(), c.getG(), c.getB()}, {dir.x, dir.y, dir.z}, l.getSpotCutoff(), l.isSpotLight(), 0};
+        lightRecords.push_back(r);
+    }
+
+    vector<PrimitiveRecord> records(objects.size());
+    for (size_t k = 0; k < objects.size(); k++) objects[k]->encode(records[k]);
+
+    vector<PageEntry> table(pageCount);
+    int64_t offset = sizeof(header) + lightRecords.size() * sizeof(LightRecord) +
+                     (objects.size() - paged) * sizeof(PrimitiveRecord) + table.size() * sizeof(PageEntry);
+    for (int p = 0; p < pageCount; p++) {
+        PageEntry& entry = table[p];
+        entry.offset = offset + (int64_t)p * perPage * sizeof(PrimitiveRecord);
+        entry.count = min(perPage, paged - p * perPage);
+
+        Vector3D pageLo(INF, INF, INF), pageHi(-INF, -INF, -INF);
+        for (int k = p * perPage; k < p * perPage + entry.count; k++) {
+            objects[k]->bounds(lo, hi);
+            pageLo = Vector3D(min(pageLo.x, lo.x), min(pageLo.y, lo.y), min(pageLo.z, lo.z));
+            pageHi = Vector3D(max(pageHi.x, hi.x), max(pageHi.y, hi.y), max(pageHi.z, hi.z));
+        }
+        double box[] = {pageLo.x, pageLo.y, pageLo.z, pageHi.x, pageHi.y, pageHi.z};
+        copy(box, box + 3, entry.lo);
+        copy(box + 3, box + 6, entry.hi);
+    }
+
+    ofstream out(path, ios::binary);
+    out.write((char*)&header, sizeof(header));
+    out.write((char*)lightRecords.data(), lightRecords.size() * sizeof(LightRecord));
+    out.write((char*)(records.data() + paged), (objects.size() - paged) * sizeof(PrimitiveRecord));
+    out.write((char*)table.data(), table.size() * sizeof(PageEntry));
+    out.write((char*)records.data(), paged * sizeof(PrimitiveRecord));
+    out.close();
+    if (!out) {
+        cerr << "Unable to write page file " << path << endl;
+        return false;
+    }
+
+    cout << "Wrote " << paged << " objects in " << pageCount << " pages of up to " << perPage
+         << " and " << objects.size() - paged << " resident objects to " << path << endl;
+    return true;
+}
+
+/*
+ * A scene traced from a page file without holding all of it in memory. The
+ * page table, a tree over the page boxes, the lights and the unbounded
+ * objects stay resident. A page is read with pread() the first time a ray
+ * reaches its box, decoded into an arena of its own with a small tree over
+ * its objects, and kept in a cache of at most capacity bytes that evicts the
+ * least recently used page first.
+ *
+ * Each thread first looks in the last PAGE_RECENT pages it used, which
+ * takes no lock. Such an entry only counts while the cache still holds that
+ * copy of the page: every slot has a generation, bumped when its page is
+ * loaded or evicted, and a thread drops its entries whose generation moved
+ * on. Lookups answered this way mark the page, and eviction gives a marked
+ * page a second chance instead of dropping a page the threads are using.
+ *
+ * Loaded pages are shared, so a page evicted while a thread still traverses
+ * it, or holds one of its objects from objectAt(), is freed once that thread
+ * lets go. The resident bytes reported count every page still alive, held
+ * by the cache or not. Two threads missing on the same page both read it
+ * and the later copy is dropped.
+ *
+ * A page that cannot be read, or does not decode, marks the scene failed()
+ * and is traced as empty from then on; renders check failed() and give up
+ * on the image instead of the process exiting under the workers.
+ *
+ * Paged objects keep the indices of the scene the file was made from, pages
+ * holding consecutive ranges of them, and nearest() breaks ties the way
+ * ObjectBvh does, so a paged render matches the in-memory one exactly.
+ */
+class PagedScene {
+    struct Slot {
+        shared_ptr<ScenePage> page;
+        list<int>::iterator position;
+        // bumped whenever page is loaded or evicted
+        atomic<unsigned long long> generation{0};
+        // taken from a thread's recent pages since it last moved to the front
+        atomic<bool> touched{false};
+    };
+
+    string path;
+    int fd = -1;
+    int perPage = 0, pagedCount = 0;
+    vector<PageEntry> table;
+    ObjectBvh pageTree;
+
+    mutex lock;
+    // open() count, so recent pages of an earlier file are never taken for this one's
+    unsigned long long opening = 0;
+    vector<Slot> slots;
+    // loaded pages, most recently used first
+    list<int> recency;
+    // bytes of the pages the cache holds, kept within capacity
+    size_t capacity = 0, cachedBytes = 0;
+    shared_ptr<atomic<size_t>> residentBytes = make_shared<atomic<size_t>>(0);
+
+    atomic<bool> broken{false};
+    string failure;
+    // stands in for objects of a page that could not be read
+    Object missing;
+
+    void fail(string reason) {
+        lock_guard<mutex> guard(lock);
+        if (broken) return;
+        failure = reason;
+        broken = true;
+        cerr << reason << endl;
+    }
+
+    bool readAt(void* data, size_t size, off_t& offset) {
+        char* bytes = (char*)data;
+        while (size > 0) {
+            ssize_t got = pread(fd, bytes, size, offset);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                return false;
+            }
+            bytes += got;
+            size -= got;
+            offset += got;
+        }
+        return true;
+    }
+
+    // page p from the file, or an empty page after marking the scene failed
+    shared_ptr<ScenePage> read(int p) {
+        PageEntry& entry = table[p];
+        vector<PrimitiveRecord> records(entry.count);
+        off_t offset = entry.offset;
+        shared_ptr<ScenePage> page = make_shared<ScenePage>();
+        if (!readAt(records.data(), records.size() * sizeof(PrimitiveRecord), offset)) {
+            fail("Unable to read page " + to_string(p) + " of " + path);
+            records.clear();
+        }
+
+        for (PrimitiveRecord& r : records) {
+            Object* o = Object::decode(r, page->arena);
+            if (!o) {
+                fail("Page " + to_string(p) + " of " + path + " is corrupt");
+                page->objects.clear();
+                break;
+            }
+            page->objects.push_back(o);
+        }
+        page->bvh.build(page->objects);
+        page->bytes = sizeof(ScenePage) + page->arena.bytesUsed() + page->objects.capacity() * sizeof(Object*) + page->bvh.bytesUsed();
+        page->live = residentBytes;
+        *residentBytes += page->bytes;
+        return page;
+    }
+
+public:
+    // cache statistics since open(): lookups a thread's recent pages answered,
+    // then lookups, page faults and evictions of the shared cache
+    atomic<long long> recentHits{0};
+    long long sharedLookups = 0, faults = 0, evictions = 0;
+    size_t peakBytes = 0;
+
+    ~PagedScene() {
+        close();
+    }
+
+    // Opens a page file and loads its resident part into the (unloaded)
+    // scene; false if the file cannot be read or its header and page table
+    // do not describe the records it holds.
+    bool open(string file, size_t cacheBytes) {
+        close();
+        fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            cerr << "Unable to open file " << file << endl;
+            return false;
+        }
+        path = file;
+
+        struct stat info;
+        int64_t fileBytes = (fstat(fd, &info) == 0) ? info.st_size : 0;
+        // count records of size bytes could be in the file at all, so a bad header allocates nothing
+        auto fits = [&](int64_t count, size_t size) {
+            return count >= 0 && count <= fileBytes / (int64_t)size;
+        };
+
+        PageFileHeader header;
+        vector<LightRecord> lightRecords;
+        vector<PrimitiveRecord> resident;
+        off_t offset = 0;
+        bool ok = readAt(&header, sizeof(header), offset) && memcmp(header.magic, PAGE_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                  header.version == PAGE_FILE_VERSION && header.objectsPerPage > 0 && fits(header.pagedObjects, sizeof(PrimitiveRecord)) &&
+                  header.pagedObjects <= INT_MAX && fits(header.lightCount, sizeof(LightRecord)) &&
+                  fits(header.residentObjects, sizeof(PrimitiveRecord)) && fits(header.pageCount, sizeof(PageEntry)) &&
+                  header.pageCount == (header.pagedObjects + header.objectsPerPage - 1) / header.objectsPerPage;
+        if (ok) {
+            lightRecords.resize(header.lightCount);
+            resident.resize(header.residentObjects);
+            table.resize(header.pageCount);
+            ok = readAt(lightRecords.data(), lightRecords.size() * sizeof(LightRecord), offset) &&
+                 readAt(resident.data(), resident.size() * sizeof(PrimitiveRecord), offset) &&
+                 readAt(table.data(), table.size() * sizeof(PageEntry), offset);
+        }
+
+        // every page but the last is full, and its records lie inside the file
+        for (int64_t p = 0; ok && p < header.pageCount; p++) {
+            PageEntry& entry = table[p];
+            int64_t expected = min<int64_t>(header.objectsPerPage, header.pagedObjects - p * header.objectsPerPage);
+            ok = entry.count == expected && entry.offset >= 0 && entry.offset <= fileBytes &&
+                 fits(entry.count, sizeof(PrimitiveRecord)) &&
+                 entry.count <= (fileBytes - entry.offset) / (int64_t)sizeof(PrimitiveRecord);
+        }
+        for (PrimitiveRecord& r : resident) {
+            Object* o = ok ? Object::decode(r, sceneArena) : nullptr;
+            if (o) objects.push_back(o);
+            else ok = false;
+        }
+        if (!ok) {
+            cerr << file << " is not a page file this build can read" << endl;
+            close();
+            return false;
+        }
+
+        recursion_level = header.recursionLevel;
+        pixels = header.pixels;
+        for (LightRecord& r : lightRecords) {
+            Light l(Vector3D(r.position[0], r.position[1], r.position[2]), Color(r.color[0], r.color[1], r.color[2]));
+            if (r.spot) l.setSpotLight(Vector3D(r.direction[0], r.direction[1], r.direction[2]), r.cutoff);
+            lights.push_back(l);
+        }
+
+        vector<Vector3D> lo, hi;
+        for (PageEntry& entry : table) {
+            lo.push_back(Vector3D(entry.lo[0], entry.lo[1], entry.lo[2]));
+            hi.push_back(Vector3D(entry.hi[0], entry.hi[1], entry.hi[2]));
+        }
+        pageTree.build(lo, hi);
+
+        perPage = header.objectsPerPage;
+        pagedCount = header.pagedObjects;
+        pagedContentHash = header.contentHash;
+        capacity = cacheBytes;
+        slots = vector<Slot>(table.size());
+        opening++;
+        recentHits = 0;
+        sharedLookups = faults = evictions = 0;
+        peakBytes = 0;
+        broken = false;
+        failure.clear();
+        return true;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        opening++;
+        table.clear();
+        slots.clear();
+        recency.clear();
+        cachedBytes = 0;
+        perPage = pagedCount = 0;
+    }
+
+    int objectCount() {
+        return pagedCount;
+    }
+
+    // a page could not be read since open(); the render that reached it is wrong
+    bool failed() {
+        return broken;
+    }
+
+    string failureReason() {
+        lock_guard<mutex> guard(lock);
+        return failure;
+    }
+
+    // page p, read from the file unless this thread or the cache has it
+    shared_ptr<ScenePage> page(int p) {
+        struct RecentPage {
+            PagedScene* scene = nullptr;
+            unsigned long long opening = 0, generation = 0;
+            int page = -1;
+            shared_ptr<ScenePage> loaded;
+        };
+        static thread_local RecentPage recent[PAGE_RECENT];
+        static thread_local int nextRecent = 0;
+
+        // an entry of this file whose page the cache has not let go of since
+        auto current = [&](RecentPage& r) {
+            return r.scene == this && r.opening == opening && r.generation == slots[r.page].generation.load(memory_order_acquire);
+        };
+
+        for (RecentPage& r : recent) {
+            if (r.page != p || !current(r)) continue;
+            recentHits.fetch_add(1, memory_order_relaxed);
+            if (!slots[p].touched.load(memory_order_relaxed)) slots[p].touched.store(true, memory_order_relaxed);
+            return r.loaded;
+        }
+
+        unsigned long long generation;
+        shared_ptr<ScenePage> found = sharedPage(p, generation);
+        recent[nextRecent] = {this, opening, generation, p, found};
+        nextRecent = (nextRecent + 1) % PAGE_RECENT;
+
+        // let go of the pages evicted or reloaded since this thread took them
+        for (RecentPage& r : recent) {
+            if (r.loaded && !current(r)) r = RecentPage();
+        }
+        return found;
+    }
+
+    // page p from the shared cache, reading it on a miss; generation is its slot's
+    shared_ptr<ScenePage> sharedPage(int p, unsigned long long& generation) {
+        {
+            lock_guard<mutex> guard(lock);
+            sharedLookups++;
+            Slot& slot = slots[p];
+            if (slot.page) {
+                recency.splice(recency.begin(), recency, slot.position);
+                slot.touched = false;
+                generation = slot.generation;
+                return slot.page;
+            }
+            faults++;
+        }
+
+        shared_ptr<ScenePage> loaded = read(p);
+
+        lock_guard<mutex> guard(lock);
+        Slot& slot = slots[p];
+        if (slot.page) {
+            generation = slot.generation;
+            return slot.page;
+        }
+        slot.page = loaded;
+        generation = ++slot.generation;
+        slot.touched = false;
+        recency.push_front(p);
+        slot.position = recency.begin();
+        cachedBytes += loaded->bytes;
+
+        // least recently used first, but a page threads took from their recent pages goes round once more
+        int chances = recency.size();
+        while (cachedBytes > capacity && recency.size() > 1 && recency.back() != p) {
+            Slot& victim = slots[recency.back()];
+            if (victim.touched && chances-- > 0) {
+                victim.touched = false;
+                recency.splice(recency.begin(), recency, prev(recency.end()));
+                continue;
+            }
+            cachedBytes -= victim.page->bytes;
+            victim.page.reset();
+            victim.generation++;
+            recency.pop_back();
+            evictions++;
+        }
+        peakBytes = max(peakBytes, residentBytes->load());
+        return loaded;
+    }
+
+    double intersect(int k, Ray& ray) {
+        Color clr;
+        if (k >= pagedCount) return intersectPrimitive(sceneObjects()[k - pagedCount], ray, clr);
+        int p = k / perPage;
+        shared_ptr<ScenePage> loaded = page(p);
+        if (loaded->objects.empty()) return -1.0;
+        return intersectPrimitive(loaded->objects[k - p * perPage], ray, clr);
+    }
+
+    Object* object(int k) {
+        if (k >= pagedCount) return sceneObjects()[k - pagedCount];
+
+        // keep the page alive for this thread's next few lookups
+        static thread_local shared_ptr<ScenePage> held[PAGE_HOLDS];
+        static thread_local int next = 0;
+        int p = k / perPage;
+        shared_ptr<ScenePage> loaded = page(p);
+        if (loaded->objects.empty()) return &missing;
+        Object* o = loaded->objects[k - p * perPage];
+        held[next] = move(loaded);
+        next = (next + 1) % PAGE_HOLDS;
+        return o;
+    }
+
+    int nearest(Ray& ray, double& tmin) {
+        Color clr;
+        int found = -1;
+
+        // resident objects come after every paged one, so they never win a tie against them
+        vector<Object*>& resident = sceneObjects();
+        for (int k = 0; k < (int)resident.size(); k++) {
+            double t = intersectPrimitive(resident[k], ray, clr);
+            if (t > 0 && t < tmin) {
+                found = pagedCount + k;
+                tmin = t;
+            }
+        }
+
+        pageTree.nearest(ray, tmin, [&](int p) {
+            // objects of an earlier page than the best hit have lower indices and win ties with it
+            bool winsTies = found == -1 || found >= pagedCount || p < found / perPage;
+            double limit = winsTies ? nextafter(tmin, INF) : tmin;
+
+            shared_ptr<ScenePage> loaded = page(p);
+            int local = loaded->bvh.nearest(ray, limit, [&](int k) { return intersectPrimitive(loaded->objects[k], ray, clr); });
+            if (local == -1) return -1.0;
+            found = p * perPage + local;
+            return limit;
+        });
+        return found;
+    }
+
+    int any(Ray& ray, double tmax, int skip) {
+        Color clr;
+        vector<Object*>& resident = sceneObjects();
+        for (int k = 0; k < (int)resident.size(); k++) {
+            if (pagedCount + k == skip) continue;
+            double t = intersectPrimitive(resident[k], ray, clr);
+            if (t > 0 && t < tmax) return pagedCount + k;
+        }
+
+        int blocker = -1;
+        pageTree.any(ray, tmax, [&](int p) {
+            shared_ptr<ScenePage> loaded = page(p);
+            int first = p * perPage;
+            int local = loaded->bvh.any(ray, tmax, [&](int k) {
+                return (first + k == skip) ? -1.0 : intersectPrimitive(loaded->objects[k], ray, clr);
+            });
+            if (local == -1) return -1.0;
+            blocker = first + local;
+            return intersectPrimitive(loaded->objects[local], ray, clr);
+        });
+        return blocker;
+    }
+
+    // one line of cache statistics
+    string report() {
+        lock_guard<mutex> guard(lock);
+        long long recent = recentHits, lookups = recent + sharedLookups;
+        ostringstream line;
+        line << "Page cache: " << lookups << " lookups, " << fixed << setprecision(1)
+             << (lookups ? 100.0 * recent / lookups : 0.0) << "% from threads' recent pages, "
+             << (sharedLookups ? 100.0 * (sharedLookups - faults) / sharedLookups : 100.0) << "% hits in the shared cache, "
+             << faults << " page faults, " << evictions << " evictions, peak " << peakBytes / 1024 << " KiB resident of "
+             << capacity / 1024 << " KiB, " << table.size() << " pages";
+        return line.str();
+    }
+};
+
+PagedScene pagedScene;
+
+int pagedObjectCount() {
+    return pagedScene.objectCount() + objects.size();
+}
+
+Object* pagedObject(int k) {
+    return pagedScene.object(k);
+}
+
+double pagedIntersect(int k, Ray& ray) {
+    return pagedScene.intersect(k, ray);
+}
+
+int pagedNearest(Ray& ray, double& tmin) {
+    return pagedScene.nearest(ray, tmin);
+}
+
+int pagedAny(Ray& ray, double tmax, int skip) {
+    return pagedScene.any(ray, tmax, skip);
+}
+
+bool pagedSceneFailed() {
+    return pagedMode && pagedScene.failed();
+}
+
+// loadData() for a page file: its resident part becomes the scene and pages load as rays reach them
+void loadPagedScene(string path) {
+    unloadScene();
+    if (!pagedScene.open(path, pageCacheBytes)) exit(1);
+    pagedMode = true;
+    compileLights();
+    sceneBvh.build(objects);
+    sceneGeometryVersion++;
+}
+
+void closePagedScene() {
+    pagedScene.close();
+    pagedMode = false;
+    pagedContentHash = 0;
+}
+
+#endif // PAGEDSCENE_H
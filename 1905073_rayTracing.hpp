@@ -2,10 +2,179 @@
 #define RAYTRACING_H
 
 #include "1905073_classes.hpp"
+#include "1905073_lightTree.hpp"
+#include "1905073_arena.hpp"
+#include "1905073_bvh.hpp"
 
 extern vector<Object*> objects;
 extern vector<Light> lights;
+extern vector<RenderLight> pointLights, spotLights;
+extern LightTree lightTree;
+extern ObjectBvh sceneBvh;
 extern int recursion_level;
+extern double reflection_threshold;
+extern bool manyLightMode;
+extern int lightSampleBudget;
+
+// Objects the calling thread traces against: the scene itself, or a replica
+// on the thread's own NUMA node (see 1905073_numa.hpp). Same objects in the
+// same order either way, so indices are interchangeable.
+thread_local vector<Object*>* traceObjects = nullptr;
+
+inline vector<Object*>& sceneObjects() {
+    return traceObjects ? *traceObjects : objects;
+}
+
+// The hierarchy over sceneObjects(): sceneBvh or the node's copy of it.
+thread_local ObjectBvh* traceBvh = nullptr;
+
+inline ObjectBvh& sceneTree() {
+    return traceBvh ? *traceBvh : sceneBvh;
+}
+
+// Out-of-core scenes (see 1905073_pagedScene.hpp) keep their bounded objects
+// in pages on disk, numbered ahead of the resident ones in objects, and are
+// traced through a tree over the pages instead of sceneBvh.
+extern bool pagedMode;
+int pagedObjectCount();
+Object* pagedObject(int k);
+int pagedNearest(Ray& ray, double& tmin);
+int pagedAny(Ray& ray, double tmax, int skip);
+double pagedIntersect(int k, Ray& ray);
+// a page could not be read: whatever was traced since is not the scene
+bool pagedSceneFailed();
+
+inline int sceneObjectCount() {
+    return pagedMode ? pagedObjectCount() : objects.size();
+}
+
+// Object k, for shading a hit. A paged object stays loaded until the calling
+// thread has looked up PAGE_HOLDS more, so tests that look up objects per
+// light or per ray use intersectObject() instead.
+inline Object* objectAt(int k) {
+    return pagedMode ? pagedObject(k) : sceneObjects()[k];
+}
+
+/*
+ * Calls f with o as its concrete primitive. The set of primitives is closed
+ * and each of them is final, so the intersect, normal and colour calls f
+ * makes are direct and can be inlined into the trace loops instead of going
+ * through the vtable. The virtual interface stays for drawing and for any
+ * object without a kind.
+ */
+template <typename F>
+inline auto visitPrimitive(Object* o, F&& f) {
+    switch (o->getKind()) {
+        case KIND_SPHERE: return f(*static_cast<Sphere*>(o));
+        case KIND_TRIANGLE: return f(*static_cast<Triangle*>(o));
+        case KIND_QUADRIC: return f(*static_cast<GeneralQuadricSurface*>(o));
+        case KIND_FLOOR: return f(*static_cast<Floor*>(o));
+        default: return f(*o);
+    }
+}
+
+inline double intersectPrimitive(Object* o, Ray r, Color& clr) {
+    return visitPrimitive(o, [&](auto& p) { return p.intersect(r, clr, 0); });
+}
+
+// distance along ray to object k, as intersectPrimitive gives it
+inline double intersectObject(int k, Ray& ray) {
+    Color clr;
+    return pagedMode ? pagedIntersect(k, ray) : intersectPrimitive(sceneObjects()[k], ray, clr);
+}
+
+// Nearest object hit at a distance in (0, tmin), or -1; tmin is lowered to that distance.
+inline int nearestObject(Ray& ray, double& tmin) {
+    if (pagedMode) return pagedNearest(ray, tmin);
+    vector<Object*>& scene = sceneObjects();
+    Color clr;
+    return sceneTree().nearest(ray, tmin, [&](int k) { return intersectPrimitive(scene[k], ray, clr); });
+}
+
+// Some object other than skip hit at a distance in (0, tmax), or -1.
+inline int blockingObject(Ray& ray, double tmax, int skip = -1) {
+    if (pagedMode) return pagedAny(ray, tmax, skip);
+    vector<Object*>& scene = sceneObjects();
+    Color clr;
+    return sceneTree().any(ray, tmax, [&](int k) { return (k == skip) ? -1.0 : intersectPrimitive(scene[k], ray, clr); });
+}
+
+// spreads the low 10 bits of v so that two zero bits separate consecutive bits
+inline unsigned int spreadBits(unsigned int v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+}
+
+// 30-bit Morton code of p quantized to a 1024^3 grid over [lo, hi]
+inline unsigned int mortonCode(Vector3D p, Vector3D lo, Vector3D hi) {
+    auto quantize = [](double v, double a, double b) {
+        double f = (b > a) ? (v - a) / (b - a) : 0.0;
+        return (unsigned int)std::min(std::max(f * 1023.0, 0.0), 1023.0);
+    };
+    return (spreadBits(quantize(p.x, lo.x, hi.x)) << 2) |
+           (spreadBits(quantize(p.y, lo.y, hi.y)) << 1) |
+            spreadBits(quantize(p.z, lo.z, hi.z));
+}
+
+inline void growBounds(Vector3D p, Vector3D& lo, Vector3D& hi) {
+    lo = Vector3D(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+    hi = Vector3D(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+}
+
+RenderLight& getRenderLight(int id) {
+    int points = pointLights.size();
+    return (id < points) ? pointLights[id] : spotLights[id - points];
+}
+
+// Shadow-ray results of one pixel's first hit from an earlier capture, one
+// bit per light id. A visible bit only counts once its known bit is set.
+class LightVisibility {
+public:
+    unsigned long long* known = nullptr;
+    unsigned long long* visible = nullptr;
+
+    bool lookup(int id, bool& isVisible) {
+        if (!(known[id >> 6] >> (id & 63) & 1)) return false;
+        isVisible = visible[id >> 6] >> (id & 63) & 1;
+        return true;
+    }
+
+    void record(int id, bool isVisible) {
+        known[id >> 6] |= 1ULL << (id & 63);
+        if (isVisible) visible[id >> 6] |= 1ULL << (id & 63);
+        else visible[id >> 6] &= ~(1ULL << (id & 63));
+    }
+};
+
+// Index of the object that last blocked a shadow ray towards each light on this thread, -1 if none.
+thread_local vector<int> shadowOccluders;
+
+int& cachedOccluder(int lightId) {
+    if (shadowOccluders.size() < lights.size()) shadowOccluders.resize(lights.size(), -1);
+    return shadowOccluders[lightId];
+}
+
+// Lights that shade a hit, with the factor their colour is scaled by: every
+// light at full weight, or in many-light mode lightSampleBudget picks from
+// the light tree reweighted by their probability.
+void selectLights(Vector3D& point, Vector3D& normal, vector<pair<int, double>>& selected) {
+    selected.clear();
+
+    if (!manyLightMode) {
+        for (int id = 0; id < (int)lights.size(); id++) selected.push_back({id, 1.0});
+        return;
+    }
+
+    for (int s = 0; s < lightSampleBudget; s++) {
+        double pdf;
+        int id = lightTree.sample(point, normal, nextRandom(), pdf);
+        if (id != -1) selected.push_back({id, 1.0 / (lightSampleBudget * pdf)});
+    }
+}
 
 Light::Light()
     : light_pos(Vector3D(0.0, 0.0, 0.0)), color(Color(0.0, 0.0, 0.0)), radius(0.0), segments(0), stacks(0),
@@ -41,6 +210,10 @@ Vector3D Light::getLightPos() const {
     return light_pos;
 }
 
+void Light::setLightPos(Vector3D pos) {
+    light_pos = pos;
+}
+
 void Light::draw() {
     stacks += 1;
     segments += 1;
@@ -116,6 +289,78 @@ Color Object::getColorAt(Vector3D intersectionPoint) {
     return color;
 }
 
+// Hash of everything that affects how the object renders: geometry and material.
+unsigned long long Object::hashContents(unsigned long long h) {
+    for (double v : {color.getR(), color.getG(), color.getB(),
+                     coefficients.getKa(), coefficients.getKd(), coefficients.getKs(), coefficients.getKr(),
+                     (double)shine, (double)maxReflectionDepth,
+                     reference_point.x, reference_point.y, reference_point.z, height, width, length}) {
+        h = hashCombine(h, v);
+    }
+    return h;
+}
+
+Object* Object::clone(SceneArena& arena) {
+    return arena.create<Object>(*this);
+}
+
+void Object::encode(PrimitiveRecord& r) {
+    r = PrimitiveRecord();
+    r.kind = kind;
+    r.shine = shine;
+    r.maxReflectionDepth = maxReflectionDepth;
+    double c[] = {color.getR(), color.getG(), color.getB()};
+    double k[] = {coefficients.getKa(), coefficients.getKd(), coefficients.getKs(), coefficients.getKr()};
+    copy(c, c + 3, r.color);
+    copy(k, k + 4, r.coefficients);
+    r.reference[0] = reference_point.x;
+    r.reference[1] = reference_point.y;
+    r.reference[2] = reference_point.z;
+    r.length = length;
+    r.width = width;
+    r.height = height;
+}
+
+Object* Object::decode(PrimitiveRecord& r, SceneArena& arena) {
+    double* s = r.shape;
+    Object* o;
+    switch (r.kind) {
+        case KIND_SPHERE:
+            o = arena.create<Sphere>(Vector3D(), s[0]);
+            break;
+        case KIND_TRIANGLE:
+            o = arena.create<Triangle>(Vector3D(s[0], s[1], s[2]), Vector3D(s[3], s[4], s[5]), Vector3D(s[6], s[7], s[8]));
+            break;
+        case KIND_QUADRIC:
+            o = arena.create<GeneralQuadricSurface>(s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], s[8], s[9], 0, 0, 0, Vector3D());
+            break;
+        case KIND_FLOOR:
+            o = arena.create<Floor>(0, 0);
+            break;
+        default:
+            return nullptr;
+    }
+
+    o->color = Color(r.color[0], r.color[1], r.color[2]);
+    o->coefficients = ReflectionCoefficients(r.coefficients[0], r.coefficients[1], r.coefficients[2], r.coefficients[3]);
+    o->shine = r.shine;
+    o->maxReflectionDepth = r.maxReflectionDepth;
+    o->reference_point = Vector3D(r.reference[0], r.reference[1], r.reference[2]);
+    o->length = r.length;
+    o->width = r.width;
+    o->height = r.height;
+    return o;
+}
+
+bool Object::centroid(Vector3D& c) {
+    c = reference_point;
+    return true;
+}
+
+bool Object::bounds(Vector3D& lo, Vector3D& hi) {
+    return false;
+}
+
 void Object::setColor(Color c) {
     color = c;
 }
@@ -136,101 +381,144 @@ void Object::setCoefficients(ReflectionCoefficients c) {
     coefficients = c;
 }
 
-double Object::intersectWithIllumination(Ray& r, Color& clr, int level) {
-    double tmin = this->intersect(r, clr, level);
+ReflectionCoefficients Object::getCoefficients() {
+    return coefficients;
+}
 
-    if(level == 0) return tmin;
-    
-    Vector3D ro = r.getOrigin(); 
-    Vector3D rd = r.getDirection(); 
-    Vector3D intersectionPoint = ro + (rd*tmin);
+void Object::setMaxReflectionDepth(int depth) {
+    maxReflectionDepth = depth;
+}
+
+Color Object::getLocalIllumination(Ray& r, double tmin, Vector3D& intersectionPoint, Vector3D& normal, LightVisibility* visibility) {
+    Vector3D rd = r.getDirection();
 
-    clr = calculateAmbientColor(intersectionPoint);
+    Color clr = calculateAmbientColor(intersectionPoint);
+    handleLightSource(normal, intersectionPoint, clr, tmin, rd, visibility);
 
-    Vector3D normal = calculateAndNormalizeNormal(intersectionPoint);
+    return clr;
+}
 
-    handleLightSource(normal, intersectionPoint, clr, tmin, rd);
+bool Object::spawnsReflection(Ray& r, int level) {
+    double kr = coefficients.getKr();
+    if (kr <= 0) return false;
 
-    if (level >= recursion_level) return tmin;
-    
-    handleRecursiveReflection(rd, clr, intersectionPoint, normal, level);
-    
-    return tmin;
+    if (level >= recursion_level) return false;
+    if (maxReflectionDepth >= 0 && level >= maxReflectionDepth) return false;
+
+    // the bounce could not change the pixel by a visible amount
+    return r.getWeight() * kr >= reflection_threshold;
 }
 
 Color Object::calculateAmbientColor(Vector3D& intersectionPoint) {
     double ambientColorCoefficient = coefficients.getKa();
-    Color ambientColor = getColorAt(intersectionPoint)*ambientColorCoefficient;
+    Color ambientColor = visitPrimitive(this, [&](auto& p) { return p.getColorAt(intersectionPoint); })*ambientColorCoefficient;
     ambientColor.fix();
     return ambientColor;
 }
 
 Vector3D Object::calculateAndNormalizeNormal(Vector3D& intersectionPoint) {
-    Vector3D normal = getNormalAt(intersectionPoint);
+    Vector3D normal = visitPrimitive(this, [&](auto& p) { return p.getNormalAt(intersectionPoint); });
     normal.normalize();
     return normal;
 }
 
-void Object::handleLightSource(Vector3D& normal, Vector3D& intersectionPoint, Color& clr, double tmin, Vector3D& rd) {
-    for (Light& l : lights) {
-        Vector3D lightDir = l.getLightPos() - intersectionPoint;
-        lightDir.normalize();
+void Object::handleLightSource(Vector3D& normal, Vector3D& intersectionPoint, Color& clr, double tmin, Vector3D& rd, LightVisibility* visibility) {
+    static thread_local vector<pair<int, double>> selected;
+    static thread_local LightBatch batch;
+    selectLights(intersectionPoint, normal, selected);
+    batch.count = 0;
+
+    for (auto& [id, scale] : selected) {
+        RenderLight& l = getRenderLight(id);
+
+        Vector3D lightDir;
+        if (!l.canReach(intersectionPoint, normal, lightDir)) continue;
+
         Vector3D lightPos = intersectionPoint + lightDir*0.0000000001;
         Ray lightRay(lightPos, lightDir);
 
-        if (l.isSpotLight()) {
-            Vector3D t = intersectionPoint - l.getLightPos();
-            Vector3D s = l.getSpotDirection();
-            
-            double t_length = t.getDistanceVector(Vector3D(0, 0, 0));
-            double s_length = s.getDistanceVector(Vector3D(0, 0, 0));
-
-            double angle = (acos(t.dot(s)/(t_length*s_length))) * 180/PI;
-            
-            if (angle > l.getSpotCutoff()) continue;
+        bool visible;
+        if (!visibility || !visibility->lookup(id, visible)) {
+            visible = !isInShadow(lightRay, tmin, id);
+            if (visibility) visibility->record(id, visible);
         }
 
-        if (!isInShadow(lightRay, tmin)) {
-            double lambert, phong;
-            calculateLambertAndPhong(normal, lightDir, clr, l, lambert, phong, rd, intersectionPoint);
+        if (visible) {
+            batch.add(lightDir, l.color * scale);
+            if (batch.full()) shadeLights(batch, normal, rd, clr, intersectionPoint);
         }
     }
+
+    if (batch.count) shadeLights(batch, normal, rd, clr, intersectionPoint);
+    clr.fix();
 }
 
-bool Object::isInShadow(Ray& lightRay, double tmin) {
-    double t, tMinActual = INFINITY;
-    Color tempClr;
+bool Object::isInShadow(Ray& lightRay, double tmin, int lightId) {
+    int& cached = cachedOccluder(lightId);
 
-    for (const auto& obj : objects) {
-        t = obj->intersectWithIllumination(lightRay, tempClr, 0);
-        if (t > 0 && t < tMinActual) {
-            tMinActual = t;
-        }
+    // neighbouring shadow rays towards a light are usually blocked by the same object
+    if (cached != -1 && cached < sceneObjectCount()) {
+        double t = intersectObject(cached, lightRay);
+        if (t > 0 && t < tmin) return true;
     }
-    if (tmin <= tMinActual) return false;
-    else return true;
-}
 
-void Object::calculateLambertAndPhong(Vector3D& normal, Vector3D& lightDir, Color& clr, Light& l, double& lambert, double& phong, Vector3D& rd, Vector3D& intersectionPoint) {
-    lambert = std::max(normal.dot(lightDir), 0.0);
-    Vector3D R = (((normal*2.0)*(normal.dot(lightDir)))-lightDir);
-    R.normalize();
-    phong = std::max(std::pow(rd.dot(R), shine), 0.0);
-    handleDiffuseAndSpecular(clr, l, lambert, phong, intersectionPoint);
+    int blocker = blockingObject(lightRay, tmin, cached);
+    if (blocker == -1) return false;
+    cached = blocker;
+    return true;
 }
 
-void Object::handleDiffuseAndSpecular(Color& clr, Light& l, double lambert, double phong, Vector3D& intersectionPoint) {
-    Color diffuse = l.getColor()*(coefficients.getKd() * lambert) * (getColorAt(intersectionPoint));
-    clr = clr+diffuse;
-    clr.fix();
-    Color specular = l.getColor() * (coefficients.getKs() * phong);
-    clr = clr+specular;
-    clr.fix();
-}
+/*
+ * Adds the diffuse and specular terms of the batched lights to clr and
+ * empties the batch. The terms of the batch.count lanes are computed in
+ * straight loops that builds with the full vectorizer cost model (-O3 or
+ * -fvect-cost-model=dynamic) turn into SIMD code, then added to clr in
+ * light order. clr is not clamped here: every term is non-negative, so the
+ * caller clamping once after the last batch gives the same colour as
+ * clamping after every addition.
+ */
+void Object::shadeLights(LightBatch& batch, Vector3D& normal, Vector3D& rd, Color& clr, Vector3D& intersectionPoint) {
+    double diffuse[LIGHT_BATCH], phong[LIGHT_BATCH], power[LIGHT_BATCH];
+    double rx[LIGHT_BATCH], ry[LIGHT_BATCH], rz[LIGHT_BATCH], length[LIGHT_BATCH];
+    double kd = coefficients.getKd(), ks = coefficients.getKs();
+    int n = batch.count;
+
+    // reflection of each light direction about the normal
+    for (int k = 0; k < n; k++) {
+        double cosine = normal.x * batch.dx[k] + normal.y * batch.dy[k] + normal.z * batch.dz[k];
+        diffuse[k] = kd * (cosine < 0.0 ? 0.0 : cosine);
+        rx[k] = (normal.x * 2.0) * cosine - batch.dx[k];
+        ry[k] = (normal.y * 2.0) * cosine - batch.dy[k];
+        rz[k] = (normal.z * 2.0) * cosine - batch.dz[k];
+        length[k] = rx[k] * rx[k] + ry[k] * ry[k] + rz[k] * rz[k];
+    }
+    // sqrt may set errno, which keeps it out of the vector loops
+    for (int k = 0; k < n; k++) length[k] = std::sqrt(length[k]);
+    for (int k = 0; k < n; k++) {
+        power[k] = rd.x * (rx[k] / length[k]) + rd.y * (ry[k] / length[k]) + rd.z * (rz[k] / length[k]);
+        phong[k] = 1.0;
+    }
 
-void Object::handleRecursiveReflection(Vector3D& rd, Color& clr, Vector3D& intersectionPoint, Vector3D& normal, int level) {
-    Ray reflectedRay = get_reflectedRay(intersectionPoint, normal, rd);
-    handleReflectedColor(reflectedRay, clr, level);
+    // power^shine by squaring, the same integer exponent in every lane
+    for (int e = abs(shine); e; e >>= 1) {
+        if (e & 1) for (int k = 0; k < n; k++) phong[k] *= power[k];
+        for (int k = 0; k < n; k++) power[k] *= power[k];
+    }
+    if (shine < 0) for (int k = 0; k < n; k++) phong[k] = 1.0 / phong[k];
+    for (int k = 0; k < n; k++) phong[k] = ks * (phong[k] < 0.0 ? 0.0 : phong[k]);
+
+    Color surface = visitPrimitive(this, [&](auto& p) { return p.getColorAt(intersectionPoint); });
+    double r = clr.getR(), g = clr.getG(), b = clr.getB();
+    for (int k = 0; k < n; k++) {
+        r += (batch.r[k] * diffuse[k]) * surface.getR();
+        g += (batch.g[k] * diffuse[k]) * surface.getG();
+        b += (batch.b[k] * diffuse[k]) * surface.getB();
+        r += batch.r[k] * phong[k];
+        g += batch.g[k] * phong[k];
+        b += batch.b[k] * phong[k];
+    }
+    clr = Color(r, g, b);
+    batch.count = 0;
 }
 
 Ray Object::get_reflectedRay(Vector3D& intersectionPoint, Vector3D& normal, Vector3D& rd) {
@@ -242,31 +530,72 @@ Ray Object::get_reflectedRay(Vector3D& intersectionPoint, Vector3D& normal, Vect
     return Ray(reflectedRayOrigin, reflectedRayDir);
 }
 
-void Object::handleReflectedColor(Ray& reflectedRay, Color& clr, int level) {
-    Color reflectedColor;
-    int nearest = getNearestIntersectingObject(reflectedRay, reflectedColor);
+int getNearestIntersectingObject(Ray& ray, double& tmin) {
+    tmin = INFINITY;
+    return nearestObject(ray, tmin);
+}
+
+// Nearest hit of a ray with what shading needs from it. Every object owns its
+// material, so the object index is also the material id.
+struct SurfaceHit {
+    int object = -1;
+    double t = INFINITY;
+    Vector3D point, normal;
+};
+
+bool findSurfaceHit(Ray& ray, SurfaceHit& hit) {
+    hit.object = getNearestIntersectingObject(ray, hit.t);
+    if (hit.object == -1) return false;
+
+    hit.point = ray.getPointAtParameter(hit.t);
+    hit.normal = objectAt(hit.object)->calculateAndNormalizeNormal(hit.point);
+    return true;
+}
+
+// Follows a ray from its first hit through its reflection bounces without
+// recursion: the ray's weight is the path throughput, each hit adds its local
+// illumination scaled by it, and the reflected ray replaces the current one.
+// When visibility is given, the first hit takes its shadow-ray results from
+// it and records the ones it had to trace.
+Color traceFromHit(Ray ray, SurfaceHit hit, LightVisibility* visibility = nullptr) {
+    Color radiance;
+
+    for (int level = 1; ; level++) {
+        Object* object = objectAt(hit.object);
+        Vector3D rd = ray.getDirection();
 
-    if (nearest != -1) {
-        double reflected_min = objects[nearest]->intersectWithIllumination(reflectedRay, reflectedColor, level + 1);
-        clr = clr + reflectedColor*coefficients.getKr();
-        clr.fix();
+        LightVisibility* hitVisibility = (level == 1) ? visibility : nullptr;
+        radiance = radiance + object->getLocalIllumination(ray, hit.t, hit.point, hit.normal, hitVisibility) * ray.getWeight();
+
+        if (!object->spawnsReflection(ray, level)) break;
+
+        double weight = ray.getWeight() * object->getCoefficients().getKr();
+        ray = object->get_reflectedRay(hit.point, hit.normal, rd);
+        ray.setWeight(weight);
+
+        if (!findSurfaceHit(ray, hit)) break;
     }
+
+    radiance.fix();
+    return radiance;
 }
 
-int Object::getNearestIntersectingObject(Ray& reflectedRay, Color& reflectedColor) {
-        
-        int nearest = -1;
-        double reflected_min = INFINITY;
+Color traceRay(Ray ray) {
+    SurfaceHit hit;
+    if (!findSurfaceHit(ray, hit)) return Color();
+    return traceFromHit(ray, hit);
+}
 
-        for (int i = 0; i < objects.size(); i++) {
-            double t_reflected = objects[i]->intersectWithIllumination(reflectedRay, reflectedColor, 0);
-            if(t_reflected>0 && t_reflected < reflected_min){
-                nearest = i;
-                reflected_min = t_reflected;
-            } 
-        }
+unsigned long long Floor::hashContents(unsigned long long h) {
+    return Object::hashContents(hashCombine(h, 4));
+}
 
-    return nearest;
+Object* Floor::clone(SceneArena& arena) {
+    return arena.create<Floor>(*this);
+}
+
+bool Floor::centroid(Vector3D& c) {
+    return false;
 }
 
 void Floor::draw() {
@@ -345,6 +674,26 @@ double Sphere::intersect(Ray r, Color clr, int level) {
 
 }
 
+unsigned long long Sphere::hashContents(unsigned long long h) {
+    return Object::hashContents(hashCombine(hashCombine(h, 1), radius));
+}
+
+Object* Sphere::clone(SceneArena& arena) {
+    return arena.create<Sphere>(*this);
+}
+
+void Sphere::encode(PrimitiveRecord& r) {
+    Object::encode(r);
+    r.shape[0] = radius;
+}
+
+bool Sphere::bounds(Vector3D& lo, Vector3D& hi) {
+    Vector3D extent(radius, radius, radius);
+    lo = reference_point - extent;
+    hi = reference_point + extent;
+    return true;
+}
+
 void Sphere::draw() {
     glTranslatef(reference_point.getX(), reference_point.getY(), reference_point.getZ());
 
@@ -415,6 +764,34 @@ double Triangle::intersect(Ray r, Color clr, int level) {
     return (t > EPSILON) ? t : -1;
 }
 
+unsigned long long Triangle::hashContents(unsigned long long h) {
+    h = hashCombine(h, 2);
+    for (double v : {v1.x, v1.y, v1.z, v2.x, v2.y, v2.z, v3.x, v3.y, v3.z}) h = hashCombine(h, v);
+    return Object::hashContents(h);
+}
+
+Object* Triangle::clone(SceneArena& arena) {
+    return arena.create<Triangle>(*this);
+}
+
+void Triangle::encode(PrimitiveRecord& r) {
+    Object::encode(r);
+    double v[] = {v1.x, v1.y, v1.z, v2.x, v2.y, v2.z, v3.x, v3.y, v3.z};
+    copy(v, v + 9, r.shape);
+}
+
+bool Triangle::centroid(Vector3D& c) {
+    c = (v1 + v2 + v3) / 3.0;
+    return true;
+}
+
+bool Triangle::bounds(Vector3D& lo, Vector3D& hi) {
+    lo = hi = v1;
+    growBounds(v2, lo, hi);
+    growBounds(v3, lo, hi);
+    return true;
+}
+
 void Triangle::draw() {
     glBegin(GL_TRIANGLES);{
         glColor3f(color.getR(), color.getG(), color.getB());
@@ -482,6 +859,47 @@ Vector3D GeneralQuadricSurface::getNormalAt(Vector3D intersectionPoint) {
     return n;
 }
 
+unsigned long long GeneralQuadricSurface::hashContents(unsigned long long h) {
+    h = hashCombine(h, 3);
+    for (double v : {A, B, C, D, E, F, G, H, I, J}) h = hashCombine(h, v);
+    return Object::hashContents(h);
+}
+
+Object* GeneralQuadricSurface::clone(SceneArena& arena) {
+    return arena.create<GeneralQuadricSurface>(*this);
+}
+
+void GeneralQuadricSurface::encode(PrimitiveRecord& r) {
+    Object::encode(r);
+    double q[] = {A, B, C, D, E, F, G, H, I, J};
+    copy(q, q + 10, r.shape);
+}
+
+// a zero dimension leaves the surface unclipped along that axis
+bool GeneralQuadricSurface::centroid(Vector3D& c) {
+    if (length <= 0 || width <= 0 || height <= 0) return false;
+    c = reference_point + Vector3D(length, width, height) * 0.5;
+    return true;
+}
+
+bool GeneralQuadricSurface::bounds(Vector3D& lo, Vector3D& hi) {
+    if (length <= 0 || width <= 0 || height <= 0) return false;
+    lo = reference_point;
+    hi = reference_point + Vector3D(length, width, height);
+    return true;
+}
+
+// substitutes p - d for p in the quadric equation, d being the move
+void GeneralQuadricSurface::setReferencePoint(Vector3D ref) {
+    Vector3D d = ref - reference_point;
+    double moved = A * d.x * d.x + B * d.y * d.y + C * d.z * d.z + D * d.x * d.y + E * d.x * d.z + F * d.y * d.z;
+    J += moved - G * d.x - H * d.y - I * d.z;
+    G -= 2 * A * d.x + D * d.y + E * d.z;
+    H -= 2 * B * d.y + D * d.x + F * d.z;
+    I -= 2 * C * d.z + E * d.x + F * d.y;
+    reference_point = ref;
+}
+
 bool GeneralQuadricSurface::withinReferenceCube(Vector3D p) {
     if (height != 0 && (p.getZ() < reference_point.getZ() || p.getZ() > reference_point.getZ() + height))
         return false;
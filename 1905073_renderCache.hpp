@@ -0,0 +1,84 @@
+#ifndef RENDERCACHE_H
+#define RENDERCACHE_H
+
+#include <filesystem>
+#include <unistd.h>
+#include "1905073_classes.hpp"
+
+namespace fs = std::filesystem;
+
+/*
+ * Finished images stored on disk under the hash of everything that went
+ * into them. A file's modification time is its last use: hits touch it,
+ * and once the directory grows past its capacity the least recently used
+ * images are deleted first. Entries are copied under a temporary name and
+ * renamed into place, so fetch() never sees a partly written image.
+ */
+class RenderCache {
+    string directory;
+    uintmax_t capacity;
+
+public:
+    RenderCache(string directory, uintmax_t capacity) : directory(directory), capacity(capacity) {}
+
+    string pathFor(unsigned long long key) {
+        stringstream name;
+        name << hex << setw(16) << setfill('0') << key << ".bmp";
+        return (fs::path(directory) / name.str()).string();
+    }
+
+    // copies the cached image for key to outPath; false on a miss
+    bool fetch(unsigned long long key, const string& outPath) {
+        error_code ec;
+        string cached = pathFor(key);
+        if (!fs::exists(cached, ec)) return false;
+
+        fs::copy_file(cached, outPath, fs::copy_options::overwrite_existing, ec);
+        if (ec) return false;
+
+        fs::last_write_time(cached, fs::file_time_type::clock::now(), ec);
+        return true;
+    }
+
+    void store(unsigned long long key, const string& imagePath) {
+        error_code ec;
+        fs::create_directories(directory, ec);
+        string cached = pathFor(key), temporary = cached + "." + to_string(getpid()) + ".part";
+        fs::copy_file(imagePath, temporary, fs::copy_options::overwrite_existing, ec);
+        if (!ec) fs::rename(temporary, cached, ec);
+        if (ec) {
+            cerr << "Unable to add " << imagePath << " to the render cache: " << ec.message() << endl;
+            fs::remove(temporary, ec);
+            return;
+        }
+        evict();
+    }
+
+    void evict() {
+        error_code ec;
+        vector<pair<fs::file_time_type, fs::path>> entries;
+        uintmax_t total = 0;
+
+        auto abandoned = fs::file_time_type::clock::now() - chrono::hours(1);
+        for (auto& entry : fs::directory_iterator(directory, ec)) {
+            if (!entry.is_regular_file(ec)) continue;
+            // copies a crashed store() never renamed into place
+            if (entry.path().extension() == ".part" && entry.last_write_time(ec) < abandoned) {
+                fs::remove(entry.path(), ec);
+                continue;
+            }
+            if (entry.path().extension() != ".bmp") continue;
+            entries.push_back({entry.last_write_time(ec), entry.path()});
+            total += entry.file_size(ec);
+        }
+
+        sort(entries.begin(), entries.end());
+        for (auto& [time, path] : entries) {
+            if (total <= capacity) break;
+            total -= fs::file_size(path, ec);
+            fs::remove(path, ec);
+        }
+    }
+};
+
+#endif // RENDERCACHE_H
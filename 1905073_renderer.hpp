@@ -0,0 +1,404 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "bitmap_image.hpp"
+#include "1905073_scene.hpp"
+#include "1905073_pagedScene.hpp"
+#include "1905073_wavefront.hpp"
+#include "1905073_gbuffer.hpp"
+#include "1905073_reprojection.hpp"
+#include "1905073_antialiasing.hpp"
+#include "1905073_workers.hpp"
+#include "1905073_numa.hpp"
+
+#define RENDER_TILE 32
+
+int windowWidth = 500;
+int windowHeight = 500;
+double viewAngle = 80;
+bool wavefrontMode = false;
+bool lightVisibilityCache = false;
+// adaptive supersampling: aaGridSize^2 stratified samples for pixels on an edge
+bool antialiasing = false;
+int aaGridSize = 3;
+double aaContrast = 0.1;
+
+GBuffer gbuffer;
+FrameHistory history;
+WorkerPool workers;
+
+void setDefaultBackgroundColor(bitmap_image& image, int imageWidth, int imageHeight) {
+    for (int i = 0; i < imageWidth; i++) {
+        for (int j = 0; j < imageHeight; j++) {
+            image.set_pixel(i, j, 0, 0, 0);
+        }
+    }
+}
+
+Vector3D calculateTopLeft(Camera& camera, double windowWidth, double windowHeight) {
+    Vector3D temp = camera.pos + camera.l * (windowHeight * 0.5) / tan((viewAngle * 0.5) * (PI / 180));
+    temp = temp - camera.r * (windowWidth / 2.0);
+    return temp + camera.u * (windowHeight / 2.0);
+}
+
+void calculatePixelParameters(Camera& camera, int imageWidth, int imageHeight, double du, double dv, Vector3D& topLeft) {
+    Vector3D temp = camera.r * (du / 2.0) - camera.u * (dv / 2.0);
+    topLeft = topLeft + temp;
+}
+
+Ray calculateRay(Camera& camera, Vector3D& topLeft, double du, double dv, int i, int j) {
+    Vector3D curPixel = topLeft + camera.r * (du * i) - camera.u * (dv * j);
+    return Ray(camera.pos, (curPixel - camera.pos));
+}
+
+// ray through a point of the image plane given in fractional pixel coordinates
+Ray calculateSubpixelRay(Camera& camera, Vector3D& topLeft, double du, double dv, double x, double y) {
+    Vector3D curPixel = topLeft + camera.r * (du * x) - camera.u * (dv * y);
+    return Ray(camera.pos, (curPixel - camera.pos));
+}
+
+void setPixelColor(bitmap_image& image, int i, int j, Color color) {
+    image.set_pixel(i, j, (color.getR() * 255), (color.getG() * 255), (color.getB()) * 255);
+}
+
+// whether ray enters the box [lo, hi] no farther than limit
+bool rayReachesBox(Ray& ray, Vector3D& lo, Vector3D& hi, double limit) {
+    Vector3D origin = ray.getOrigin(), direction = ray.getDirection();
+    double near = 0, far = limit;
+    double o[3] = {origin.x, origin.y, origin.z}, d[3] = {direction.x, direction.y, direction.z};
+    double a[3] = {lo.x, lo.y, lo.z}, b[3] = {hi.x, hi.y, hi.z};
+    for (int k = 0; k < 3; k++) {
+        if (d[k] == 0) {
+            if (o[k] < a[k] || o[k] > b[k]) return false;
+            continue;
+        }
+        double t0 = (a[k] - o[k]) / d[k], t1 = (b[k] - o[k]) / d[k];
+        if (t0 > t1) swap(t0, t1);
+        near = max(near, t0);
+        far = min(far, t1);
+        if (near > far) return false;
+    }
+    return true;
+}
+
+// Marks the pixels whose primary hit the object edits since the G-buffer was
+// traced may have changed: hits on an edited object and rays crossing the
+// box of one no farther than their own hit. False, with nothing marked, when
+// not every edit was recorded.
+bool findEditedPixels(int imageWidth, int imageHeight, Vector3D& topLeft, double du, double dv, vector<char>& retrace) {
+    int version = gbuffer.version();
+    if (!geometryEditsCover(version)) return false;
+
+    vector<int> stale;
+    vector<pair<Vector3D, Vector3D>> boxes;
+    for (size_t e = version - geometryEditsFrom; e < geometryEdits.size(); e++) {
+        GeometryEdit& edit = geometryEdits[e];
+        stale.insert(stale.end(), edit.staleObjects.begin(), edit.staleObjects.end());
+        boxes.insert(boxes.end(), edit.boxes.begin(), edit.boxes.end());
+    }
+    sort(stale.begin(), stale.end());
+    // padded as the hierarchy pads its boxes, so a hit on the box's surface is inside
+    for (auto& box : boxes) {
+        Vector3D& lo = box.first;
+        Vector3D& hi = box.second;
+        lo = Vector3D(lo.x - EPSILON * (1 + fabs(lo.x)), lo.y - EPSILON * (1 + fabs(lo.y)), lo.z - EPSILON * (1 + fabs(lo.z)));
+        hi = Vector3D(hi.x + EPSILON * (1 + fabs(hi.x)), hi.y + EPSILON * (1 + fabs(hi.y)), hi.z + EPSILON * (1 + fabs(hi.z)));
+    }
+
+    retrace.assign((size_t)imageWidth * imageHeight, 0);
+    workers.run(imageHeight, [&](int j, int worker) {
+        for (int i = 0; i < imageWidth; i++) {
+            SurfaceHit& hit = gbuffer.at(i, j);
+            bool edited = binary_search(stale.begin(), stale.end(), hit.object);
+            if (!edited && !boxes.empty()) {
+                Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
+                for (auto& box : boxes) {
+                    if (rayReachesBox(ray, box.first, box.second, hit.t)) {
+                        edited = true;
+                        break;
+                    }
+                }
+            }
+            retrace[j * imageWidth + i] = edited;
+        }
+    });
+    return true;
+}
+
+// Per-pixel path: tiles of RENDER_TILE^2 pixels are spread over the workers.
+// Primary rays are traced for every pixel unless reuseHits, and then only
+// for the pixels marked in retrace, if it is not empty.
+void renderPixels(bitmap_image& image, int imageWidth, int imageHeight, Vector3D& topLeft, double du, double dv, bool reuseHits,
+                  vector<char>& retrace) {
+    int tilesX = (imageWidth + RENDER_TILE - 1) / RENDER_TILE;
+    int tilesY = (imageHeight + RENDER_TILE - 1) / RENDER_TILE;
+
+    workers.run(tilesX * tilesY, [&](int tile, int worker) {
+        if (pagedSceneFailed()) return;
+        int x0 = (tile % tilesX) * RENDER_TILE, y0 = (tile / tilesX) * RENDER_TILE;
+        int x1 = min(x0 + RENDER_TILE, imageWidth), y1 = min(y0 + RENDER_TILE, imageHeight);
+
+        for (int i = x0; i < x1; i++) {
+            for (int j = y0; j < y1; j++) {
+                Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
+                seedRandom((unsigned long long)j * imageWidth + i);
+
+                SurfaceHit& hit = gbuffer.at(i, j);
+                if (!reuseHits) {
+                    findSurfaceHit(ray, hit);
+                } else if (!retrace.empty() && retrace[j * imageWidth + i]) {
+                    hit = SurfaceHit();
+                    findSurfaceHit(ray, hit);
+                }
+
+                LightVisibility visibility;
+                if (lightVisibilityCache) visibility = gbuffer.visibilityAt(i, j);
+                Color color = (hit.object == -1) ? Color() : traceFromHit(ray, hit, lightVisibilityCache ? &visibility : nullptr);
+
+                setPixelColor(image, i, j, color);
+            }
+        }
+    });
+}
+
+// Colours of pixels [x0, x1) x [y0, y1) of the current camera's view as rgb
+// triples, row by row. Same values as the per-pixel path, without touching
+// the G-buffer; used for tiles rendered on behalf of another process. False
+// if the scene could not be read.
+bool tracePixelBlock(int imageWidth, int imageHeight, int x0, int y0, int x1, int y1, vector<unsigned char>& rgb) {
+    refreshNodeScenes(workers);
+    Vector3D topLeft = calculateTopLeft(camera, windowWidth, windowHeight);
+    double du = (double)windowWidth / imageWidth;
+    double dv = (double)windowHeight / imageHeight;
+    calculatePixelParameters(camera, imageWidth, imageHeight, du, dv, topLeft);
+
+    int blockWidth = x1 - x0;
+    rgb.assign(blockWidth * (y1 - y0) * 3, 0);
+
+    workers.run(y1 - y0, [&](int row, int worker) {
+        int j = y0 + row;
+        for (int i = x0; i < x1; i++) {
+            Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
+            seedRandom((unsigned long long)j * imageWidth + i);
+
+            SurfaceHit hit;
+            Color color = findSurfaceHit(ray, hit) ? traceFromHit(ray, hit) : Color();
+
+            unsigned char* pixel = &rgb[(row * blockWidth + (i - x0)) * 3];
+            pixel[0] = (unsigned char)(color.getR() * 255);
+            pixel[1] = (unsigned char)(color.getG() * 255);
+            pixel[2] = (unsigned char)(color.getB() * 255);
+        }
+    });
+    return !pagedSceneFailed();
+}
+
+// Wavefront path: each worker owns a WavefrontRenderer and takes whole tiles.
+// Wavefront path, reusing hits as renderPixels does; a tile with any pixel
+// marked in retrace traces all of its primary rays.
+void captureWavefront(bitmap_image& image, int imageWidth, int imageHeight, Vector3D& topLeft, double du, double dv, bool reuseHits,
+                      vector<char>& retrace) {
+    struct WorkerState {
+        WavefrontRenderer renderer;
+        vector<SurfaceHit> tileHits;
+        vector<LightVisibility> tileVisibility;
+    };
+
+    int tilesX = (imageWidth + WAVEFRONT_TILE - 1) / WAVEFRONT_TILE;
+    int tilesY = (imageHeight + WAVEFRONT_TILE - 1) / WAVEFRONT_TILE;
+    if (workers.size() == 0) workers.resize(thread::hardware_concurrency());
+    vector<WorkerState> states(workers.size());
+
+    workers.run(tilesX * tilesY, [&](int tileId, int worker) {
+        if (pagedSceneFailed()) return;
+        WorkerState& state = states[worker];
+        int x0 = (tileId % tilesX) * WAVEFRONT_TILE, y0 = (tileId / tilesX) * WAVEFRONT_TILE;
+        int x1 = min(x0 + WAVEFRONT_TILE, imageWidth);
+        int y1 = min(y0 + WAVEFRONT_TILE, imageHeight);
+        int tileWidth = x1 - x0;
+
+        RayQueue& rays = state.renderer.primaryRays();
+        rays.clear();
+        state.tileHits.clear();
+        state.tileVisibility.clear();
+        bool reuseTile = reuseHits;
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
+                rays.push(ray, (j - y0) * tileWidth + (i - x0));
+                state.tileHits.push_back(gbuffer.at(i, j));
+                if (lightVisibilityCache) state.tileVisibility.push_back(gbuffer.visibilityAt(i, j));
+                if (!retrace.empty() && retrace[j * imageWidth + i]) reuseTile = false;
+            }
+        }
+
+        vector<Color>& radiance = state.renderer.traceTile(tileWidth * (y1 - y0), tileId, state.tileHits, reuseTile,
+                                                           lightVisibilityCache ? &state.tileVisibility : nullptr);
+
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                int p = (j - y0) * tileWidth + (i - x0);
+                setPixelColor(image, i, j, radiance[p]);
+                gbuffer.at(i, j) = state.tileHits[p];
+            }
+        }
+    });
+}
+
+void supersampleEdges(bitmap_image& image, int imageWidth, int imageHeight, Vector3D& topLeft, double du, double dv) {
+    vector<char> edge = findEdgePixels(image, gbuffer, imageWidth, imageHeight, aaContrast);
+    atomic<int> supersampled{0};
+
+    workers.run(imageHeight, [&](int j, int worker) {
+        for (int i = 0; i < imageWidth; i++) {
+            if (!edge[j * imageWidth + i]) continue;
+
+            unsigned long long pixel = (unsigned long long)j * imageWidth + i;
+            seedRandom(mixBits(pixel) ^ 0xaaULL);
+            vector<pair<double, double>> offsets = stratifiedOffsets(aaGridSize);
+
+            Color sum;
+            for (int s = 0; s < (int)offsets.size(); s++) {
+                Ray ray = calculateSubpixelRay(camera, topLeft, du, dv, i + offsets[s].first, j + offsets[s].second);
+                seedRandom(mixBits(pixel) + s + 1);
+                sum = sum + traceRay(ray);
+            }
+
+            setPixelColor(image, i, j, sum * (1.0 / offsets.size()));
+            supersampled++;
+        }
+    });
+
+    cout << "Supersampled " << supersampled << " edge pixels" << endl;
+}
+
+// Key of a render in the render cache: the scene, the camera and every setting the pixels depend on.
+unsigned long long renderKey(Camera& camera, int imageWidth, int imageHeight) {
+    unsigned long long h = sceneContentHash();
+    for (Vector3D v : {camera.pos, camera.l, camera.r, camera.u}) {
+        h = hashCombine(hashCombine(hashCombine(h, v.x), v.y), v.z);
+    }
+    for (double v : {(double)imageWidth, (double)imageHeight, (double)recursion_level, reflection_threshold,
+                     (double)manyLightMode, (double)lightSampleBudget, (double)wavefrontMode,
+                     (double)antialiasing, (double)aaGridSize, aaContrast,
+                     viewAngle, (double)windowWidth, (double)windowHeight}) {
+        h = hashCombine(h, v);
+    }
+    return h;
+}
+
+// Traces the current camera's view into image and keeps its primary hits for
+// the next render. False if the scene could not be read; image is then wrong.
+bool renderImage(bitmap_image& image, int imageWidth, int imageHeight) {
+    refreshNodeScenes(workers);
+    setDefaultBackgroundColor(image, imageWidth, imageHeight);
+
+    Vector3D topLeft = calculateTopLeft(camera, windowWidth, windowHeight);
+
+    double du = (double)windowWidth / imageWidth;
+    double dv = (double)windowHeight / imageHeight;
+
+    calculatePixelParameters(camera, imageWidth, imageHeight, du, dv, topLeft);
+
+    // camera and geometry unchanged since the last capture: only shading has to run again;
+    // after recorded object edits, only the primary rays they can reach are traced again
+    vector<char> retrace;
+    bool reuseHits = gbuffer.matches(camera, imageWidth, imageHeight);
+    if (!reuseHits && gbuffer.sameView(camera, imageWidth, imageHeight) &&
+        findEditedPixels(imageWidth, imageHeight, topLeft, du, dv, retrace)) {
+        reuseHits = true;
+        gbuffer.updateVersion();
+        cout << "Retracing primary rays of " << count(retrace.begin(), retrace.end(), 1) << " of " << retrace.size()
+             << " pixels after object edits" << endl;
+    } else if (reuseHits) {
+        cout << "Reusing primary hits of the previous capture" << endl;
+    } else {
+        gbuffer.reset(camera, imageWidth, imageHeight, workers.pinned() ? &workers : nullptr, wavefrontMode ? WAVEFRONT_TILE : RENDER_TILE);
+    }
+
+    // shadow rays of primary hits are traced again only for lights added or moved since;
+    // any object edit may change what shadows what, so it drops them all
+    if (lightVisibilityCache) {
+        int kept = (reuseHits && retrace.empty() && gbuffer.hasLightVisibility()) ? gbuffer.carryLightVisibility() : 0;
+        if (kept > 0) cout << "Reusing light visibility of " << kept << " of " << lights.size() << " lights from the previous capture" << endl;
+        else gbuffer.resetLightVisibility();
+    }
+
+    if (wavefrontMode) captureWavefront(image, imageWidth, imageHeight, topLeft, du, dv, reuseHits, retrace);
+    else renderPixels(image, imageWidth, imageHeight, topLeft, du, dv, reuseHits, retrace);
+
+    if (antialiasing && !pagedSceneFailed()) supersampleEdges(image, imageWidth, imageHeight, topLeft, du, dv);
+
+    if (pagedSceneFailed()) {
+        gbuffer.invalidate();
+        history.invalidate();
+        return false;
+    }
+
+    history.reset(imageWidth, imageHeight);
+    for (int i = 0; i < imageWidth; i++) {
+        for (int j = 0; j < imageHeight; j++) {
+            FrameSample& sample = history.at(i, j);
+            sample.object = gbuffer.at(i, j).object;
+            sample.point = gbuffer.at(i, j).point;
+            sample.color = image.get_pixel(i, j);
+        }
+    }
+    return true;
+}
+
+// Preview-quality render: reuses the previous frame's pixels through
+// reprojection and retraces only what it cannot trust. The history must be
+// usable; returns the number of retraced pixels, -1 if the scene could not be read.
+int renderPreview(bitmap_image& image, int imageWidth, int imageHeight) {
+    refreshNodeScenes(workers);
+    setDefaultBackgroundColor(image, imageWidth, imageHeight);
+
+    double planeDistance = (windowHeight * 0.5) / tan((viewAngle * 0.5) * (PI / 180));
+    Vector3D topLeft = calculateTopLeft(camera, windowWidth, windowHeight);
+
+    double du = (double)windowWidth / imageWidth;
+    double dv = (double)windowHeight / imageHeight;
+
+    calculatePixelParameters(camera, imageWidth, imageHeight, du, dv, topLeft);
+
+    ViewPlane view = {planeDistance, (double)windowWidth, (double)windowHeight, du, dv};
+    vector<FrameSample> samples;
+    vector<char> retrace = history.reproject(camera, view, image, samples);
+
+    atomic<int> retraced{0};
+    workers.run(imageHeight, [&](int j, int worker) {
+        for (int i = 0; i < imageWidth; i++) {
+            FrameSample& sample = samples[j * imageWidth + i];
+            if (!retrace[j * imageWidth + i]) continue;
+
+            Ray ray = calculateRay(camera, topLeft, du, dv, i, j);
+            seedRandom((unsigned long long)j * imageWidth + i);
+
+            SurfaceHit hit;
+            Color color = findSurfaceHit(ray, hit) ? traceFromHit(ray, hit) : Color();
+            setPixelColor(image, i, j, color);
+
+            sample.object = hit.object;
+            sample.point = hit.point;
+            sample.color = image.get_pixel(i, j);
+            retraced++;
+        }
+    });
+
+    gbuffer.invalidate();
+    if (pagedSceneFailed()) {
+        history.invalidate();
+        return -1;
+    }
+
+    // the next preview reprojects from this one; the G-buffer only holds fully traced frames
+    history.reset(imageWidth, imageHeight);
+    for (int i = 0; i < imageWidth; i++) {
+        for (int j = 0; j < imageHeight; j++) history.at(i, j) = samples[j * imageWidth + i];
+    }
+
+    return retraced;
+}
+
+#endif // RENDERER_H
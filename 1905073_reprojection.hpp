@@ -0,0 +1,117 @@
+#ifndef REPROJECTION_H
+#define REPROJECTION_H
+
+#include "bitmap_image.hpp"
+#include "1905073_gbuffer.hpp"
+
+// what the last frame saw through one pixel
+struct FrameSample {
+    int object = -1;
+    Vector3D point;
+    bitmap_image::rgb_t color;
+};
+
+// image plane of a capture, in the terms calculateRay uses
+struct ViewPlane {
+    double planeDistance, windowWidth, windowHeight, du, dv;
+};
+
+/*
+ * Previous frame kept for preview captures: every pixel's world-space hit
+ * and final colour. After a small camera step most of those points are
+ * still visible, so their colours are splatted into the new view and only
+ * the pixels reprojection cannot vouch for are traced again.
+ */
+class FrameHistory {
+    int width = 0, height = 0;
+    int geometryVersion = -1;
+    vector<FrameSample> samples;
+
+public:
+    bool usable(int imageWidth, int imageHeight) {
+        return geometryVersion == sceneGeometryVersion && width == imageWidth && height == imageHeight;
+    }
+
+    void reset(int imageWidth, int imageHeight) {
+        width = imageWidth;
+        height = imageHeight;
+        geometryVersion = sceneGeometryVersion;
+        samples.assign(width * height, FrameSample());
+    }
+
+    // for changes the geometry version does not cover, such as edited lights
+    void invalidate() {
+        geometryVersion = -1;
+    }
+
+    FrameSample& at(int i, int j) {
+        return samples[j * width + i];
+    }
+
+    /*
+     * Splats the previous samples into the view of camera, nearest first,
+     * and writes the trusted ones into image. Returns the pixels that must
+     * be retraced: disoccluded pixels, pixels showing a reflective material
+     * (their colour depends on the view), and low-confidence pixels on a
+     * silhouette, where a 4-neighbour shows another object, a clearly
+     * different depth or nothing at all.
+     */
+    vector<char> reproject(Camera& camera, ViewPlane& view, bitmap_image& image, vector<FrameSample>& reprojected) {
+        int n = width * height;
+        vector<double> depth(n, INF);
+        vector<int> source(n, -1);
+
+        for (int s = 0; s < n; s++) {
+            if (samples[s].object == -1 || samples[s].object >= sceneObjectCount()) continue;
+
+            Vector3D d = samples[s].point - camera.pos;
+            double z = d.dot(camera.l);
+            if (z <= EPSILON) continue;
+
+            double x = d.dot(camera.r) * view.planeDistance / z;
+            double y = d.dot(camera.u) * view.planeDistance / z;
+            int i = (int)floor((x + view.windowWidth / 2) / view.du);
+            int j = (int)floor((view.windowHeight / 2 - y) / view.dv);
+            if (i < 0 || i >= width || j < 0 || j >= height) continue;
+
+            int p = j * width + i;
+            double distance = sqrt(d.dot(d));
+            if (distance < depth[p]) {
+                depth[p] = distance;
+                source[p] = s;
+            }
+        }
+
+        auto consistent = [&](int p, int q) {
+            if (source[q] == -1) return false;
+            if (samples[source[q]].object != samples[source[p]].object) return false;
+            return fabs(depth[q] - depth[p]) <= 0.05 * depth[p];
+        };
+
+        vector<char> retrace(n, 1);
+        reprojected.assign(n, FrameSample());
+
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                int p = j * width + i;
+                if (source[p] == -1) continue;
+
+                FrameSample& sample = samples[source[p]];
+                if (objectAt(sample.object)->getCoefficients().getKr() > 0) continue;
+
+                if (i == 0 || !consistent(p, p - 1)) continue;
+                if (i == width - 1 || !consistent(p, p + 1)) continue;
+                if (j == 0 || !consistent(p, p - width)) continue;
+                if (j == height - 1 || !consistent(p, p + width)) continue;
+
+                retrace[p] = 0;
+                reprojected[p] = sample;
+                image.set_pixel(i, j, sample.color);
+            }
+        }
+
+        return retrace;
+    }
+};
+
+#endif // REPROJECTION_H
@@ -3,17 +3,50 @@
 using namespace std;
 
 int recursion_level, pixels;
+// bumped whenever objects are added, removed or moved; caches built from geometry compare against it
+int sceneGeometryVersion = 0;
+// reflections whose accumulated kr falls below this are not traced (one 8-bit step
+// unless --reflection-threshold says otherwise)
+double reflection_threshold = 1.0 / 255;
+// sample lightSampleBudget lights per hit from lightTree instead of shading with all of them
+bool manyLightMode = false;
+int lightSampleBudget = 4;
 vector<Object*> objects;
+// owns every object of the loaded scene
+SceneArena sceneArena;
 vector<Light> lights;
+vector<RenderLight> pointLights, spotLights;
+LightTree lightTree;
+// hierarchy over objects, rebuilt on load and refit when objects move
+ObjectBvh sceneBvh;
+// index in objects of each object in scene-file order, the floor last
+vector<int> fileOrder;
+// hash of each light id's position and cone; cached shadow results of a light stay valid while its hash is unchanged
+vector<unsigned long long> lightShapes;
 InputHandler inputHandler;
 Camera camera;
 
-void loadSceneParameters(ifstream& input) {
+// out-of-core scenes, see 1905073_pagedScene.hpp
+extern string pagedScenePath;
+extern unsigned long long pagedContentHash;
+void loadPagedScene(string path);
+void closePagedScene();
+
+void loadSceneParameters(istream& input) {
     input >> recursion_level >> pixels;
 }
 
 
-void readAndSetProperties(Object* object, ifstream& input) {
+/*
+ * Material of an object: colour, ka kd ks kr and shininess, optionally
+ * followed by
+ *
+ *     depth <n>
+ *
+ * which caps the reflections of this material the way recursion_level caps
+ * every ray's: a hit on it at level n or deeper does not reflect.
+ */
+void readAndSetProperties(Object* object, istream& input) {
     Color color;
     ReflectionCoefficients reflectionCoefficient;
     int shininess;
@@ -23,22 +56,36 @@ void readAndSetProperties(Object* object, ifstream& input) {
     object->setColor(color);
     object->setCoefficients(reflectionCoefficient);
     object->setShine(shininess);
+
+    if (!input || input.eof()) return;
+
+    // the next token is either the keyword or the start of what follows the
+    // object, which is left unread by seeking back to it
+    streampos next = input.tellg();
+    string keyword;
+    if (input >> keyword && keyword == "depth") {
+        int depth;
+        if (input >> depth) object->setMaxReflectionDepth(depth);
+        return;
+    }
+    input.clear();
+    input.seekg(next);
 }
 
-Sphere* readSphere(ifstream& input) {
+Sphere* readSphere(istream& input) {
     Vector3D center;
     double radius;
     input >> center >> radius;
     return new Sphere(center, radius);
 }
 
-Triangle* readTriangle(ifstream& input) {
+Triangle* readTriangle(istream& input) {
     Vector3D a, b, c;
     input >> a >> b >> c;
     return new Triangle(a, b, c);
 }
 
-GeneralQuadricSurface* readGeneralQuadricSurface(ifstream& input) {
+GeneralQuadricSurface* readGeneralQuadricSurface(istream& input) {
     Vector3D cubeReferencePoint;
     double A, B, C, D, E, F, G, H, I, J, length, width, height;
     input >> A >> B >> C >> D >> E >> F >> G >> H >> I >> J;
@@ -46,7 +93,7 @@ GeneralQuadricSurface* readGeneralQuadricSurface(ifstream& input) {
     return new GeneralQuadricSurface(A, B, C, D, E, F, G, H, I, J, length, width, height, cubeReferencePoint);
 }
 
-Object* readObject(ifstream& input) {
+Object* readObject(istream& input) {
     string objectShape;
     input >> objectShape;
 
@@ -62,7 +109,7 @@ Object* readObject(ifstream& input) {
     }
 }
 
-void loadObjects(ifstream& input) {
+void loadObjects(istream& input) {
     int object_count;
     input >> object_count;
 
@@ -77,7 +124,7 @@ void loadObjects(ifstream& input) {
     }
 }
 
-Light createLight(ifstream& input) {
+Light createLight(istream& input) {
     Vector3D position;
     Color color;
     input >> position >> color;
@@ -85,7 +132,7 @@ Light createLight(ifstream& input) {
     return Light(position, color);
 }
 
-Light createSpotLight(ifstream& input) {
+Light createSpotLight(istream& input) {
     Vector3D position, direction;    
     Color color;
     double cutoffAngle;
@@ -98,7 +145,7 @@ Light createSpotLight(ifstream& input) {
     return sl;
 }
 
-void loadLights(ifstream& input) {
+void loadLights(istream& input) {
     int lightsCount;
     input >> lightsCount;
 
@@ -115,6 +162,48 @@ void loadLights(ifstream& input) {
     
 }
 
+// Builds the render form of lights; lights holds point lights before spotlights,
+// so ids keep the load order.
+void compileLights() {
+    pointLights.clear();
+    spotLights.clear();
+
+    for (int i = 0; i < (int)lights.size(); i++) {
+        RenderLight l(lights[i], i);
+        if (l.isSpot) spotLights.push_back(l);
+        else pointLights.push_back(l);
+    }
+
+    lightTree.build(pointLights, spotLights);
+
+    lightShapes.assign(lights.size(), 0);
+    for (vector<RenderLight>* group : {&pointLights, &spotLights}) {
+        for (RenderLight& l : *group) {
+            unsigned long long h = 0;
+            for (double v : {l.pos.x, l.pos.y, l.pos.z, l.axis.x, l.axis.y, l.axis.z, l.cosCutoff}) h = hashCombine(h, v);
+            lightShapes[l.id] = h;
+        }
+    }
+}
+
+// Hash of the parsed scene: every object and every light as loaded. A paged
+// scene stands for its paged objects with the hash it was written with.
+unsigned long long sceneContentHash() {
+    unsigned long long h = hashCombine(pagedMode ? pagedContentHash : 0, objects.size());
+    for (Object* o : objects) h = o->hashContents(h);
+
+    h = hashCombine(h, lights.size());
+    for (Light& l : lights) {
+        Vector3D pos = l.getLightPos(), dir = l.getSpotDirection();
+        Color c = l.getColor();
+        for (double v : {pos.x, pos.y, pos.z, c.getR(), c.getG(), c.getB(),
+                         (double)l.isSpotLight(), dir.x, dir.y, dir.z, l.getSpotCutoff()}) {
+            h = hashCombine(h, v);
+        }
+    }
+    return h;
+}
+
 void addFloor(double floorWidth, double tileWidth, ReflectionCoefficients coefficients){
     Object* floor = new Floor(floorWidth, tileWidth);
     floor->setCoefficients(coefficients);
@@ -123,19 +212,230 @@ void addFloor(double floorWidth, double tileWidth, ReflectionCoefficients coeffi
     objects.push_back(floor);
 }
 
-void loadData() {
-    ifstream input("scene.txt");
-    if (!input) {
-        cerr << "Unable to open file scene.txt" << endl;
+/*
+ * Moves the parsed objects into the scene arena, bounded ones sorted by the
+ * Morton code of their centroids so neighbours in space are neighbours in
+ * memory (and in the intersection loops), unbounded ones after them in
+ * load order.
+ */
+void arrangeObjects() {
+    Vector3D lo(INF, INF, INF), hi(-INF, -INF, -INF);
+    vector<pair<unsigned int, int>> bounded;
+    vector<int> unbounded;
+    vector<Vector3D> centers(objects.size());
+
+    for (int k = 0; k < (int)objects.size(); k++) {
+        if (objects[k]->centroid(centers[k])) {
+            growBounds(centers[k], lo, hi);
+            bounded.push_back({0, k});
+        } else {
+            unbounded.push_back(k);
+        }
+    }
+    for (auto& entry : bounded) entry.first = mortonCode(centers[entry.second], lo, hi);
+    stable_sort(bounded.begin(), bounded.end(),
+                [](const pair<unsigned int, int>& a, const pair<unsigned int, int>& b) { return a.first < b.first; });
+
+    vector<int> order;
+    for (auto& entry : bounded) order.push_back(entry.second);
+    order.insert(order.end(), unbounded.begin(), unbounded.end());
+
+    vector<Object*> arranged;
+    fileOrder.assign(objects.size(), -1);
+    for (int k : order) {
+        fileOrder[k] = arranged.size();
+        arranged.push_back(objects[k]->clone(sceneArena));
+        delete objects[k];
+    }
+    objects = arranged;
+}
+
+/*
+ * Moves object index by offset in place, for animation. Spheres move their
+ * centre, triangles their vertices and quadrics their reference point along
+ * with the surface; anything else stays put and false is returned. Call
+ * refitScene() once every object of the frame has moved.
+ */
+bool translateObject(int index, Vector3D offset) {
+    Object* o = objects[index];
+    switch (o->getKind()) {
+        case KIND_SPHERE:
+            static_cast<Sphere*>(o)->setCenter(o->getReferencePoint() + offset);
+            return true;
+        case KIND_TRIANGLE: {
+            Triangle* t = static_cast<Triangle*>(o);
+            t->setVertices(t->getv1() + offset, t->getv2() + offset, t->getv3() + offset);
+            return true;
+        }
+        case KIND_QUADRIC:
+            static_cast<GeneralQuadricSurface*>(o)->setReferencePoint(o->getReferencePoint() + offset);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// brings the hierarchy up to date after objects moved, rebuilding it when refitting is no longer good enough
+void refitScene(WorkerPool& pool) {
+    if (!sceneBvh.refit(objects, pool)) {
+        sceneBvh.build(objects);
+        sceneBvh.rebuilds++;
+    }
+    sceneGeometryVersion++;
+}
+
+/*
+ * Object edits since geometryEditsFrom, one per step of sceneGeometryVersion,
+ * so a render from an unchanged camera retraces only the primary rays an edit
+ * can change (see findEditedPixels). Anything else that changes the geometry
+ * bumps the version without recording an edit, and the next render traces
+ * every pixel again.
+ */
+struct GeometryEdit {
+    // hits on these objects, numbered as before the edit, are stale
+    vector<int> staleObjects;
+    // boxes of edited objects where they are now: rays crossing one may hit it
+    vector<pair<Vector3D, Vector3D>> boxes;
+};
+#define MAX_GEOMETRY_EDITS 64
+vector<GeometryEdit> geometryEdits;
+int geometryEditsFrom = 0;
+
+// whether every change to the geometry since version is in geometryEdits
+bool geometryEditsCover(int version) {
+    return version >= geometryEditsFrom && geometryEditsFrom + (int)geometryEdits.size() == sceneGeometryVersion;
+}
+
+// bumps the version; edits of unbounded objects are not recorded, so renders fall back to tracing everything
+void recordGeometryEdit(GeometryEdit& edit, bool bounded) {
+    if (!geometryEditsCover(sceneGeometryVersion) || geometryEdits.size() >= MAX_GEOMETRY_EDITS) {
+        geometryEdits.clear();
+        geometryEditsFrom = sceneGeometryVersion;
+    }
+    sceneGeometryVersion++;
+    if (bounded) geometryEdits.push_back(edit);
+}
+
+// box of objects[index] as the edit leaves it
+bool addEditBox(GeometryEdit& edit, int index) {
+    Vector3D lo, hi;
+    if (!objects[index]->bounds(lo, hi)) return false;
+    edit.boxes.push_back({lo, hi});
+    return true;
+}
+
+/*
+ * Runtime edits. Each one updates the hierarchy for the edited object only
+ * and records what it touched, so the next render keeps the primary hits of
+ * pixels whose rays cannot reach the edited objects. Cached light visibility
+ * and the frame history are still dropped as a whole: any object may shadow
+ * any hit, and history samples are not checked against edits. Objects live
+ * in the scene arena, which frees nothing individually: removed objects stay
+ * allocated until the scene is unloaded.
+ */
+int addObject(Object* object) {
+    objects.push_back(object->clone(sceneArena));
+    delete object;
+    int index = objects.size() - 1;
+    sceneBvh.insert(index, objects);
+
+    GeometryEdit edit;
+    recordGeometryEdit(edit, addEditBox(edit, index));
+    return index;
+}
+
+// the last object takes the removed one's index
+void removeObject(int index) {
+    int last = objects.size() - 1;
+    sceneBvh.remove(index);
+    if (index != last) {
+        objects[index] = objects[last];
+        sceneBvh.renumber(last, index);
+    }
+    objects.pop_back();
+
+    for (int& slot : fileOrder) {
+        if (slot == index) slot = -1;
+        else if (slot == last) slot = index;
+    }
+
+    GeometryEdit edit;
+    edit.staleObjects = {index, last};
+    recordGeometryEdit(edit, index == last || addEditBox(edit, index));
+}
+
+bool moveObject(int index, Vector3D offset) {
+    if (!translateObject(index, offset)) return false;
+    sceneBvh.remove(index);
+    sceneBvh.insert(index, objects);
+
+    GeometryEdit edit;
+    edit.staleObjects = {index};
+    recordGeometryEdit(edit, addEditBox(edit, index));
+    return true;
+}
+
+// Light edits keep the geometry and so the primary hits of the last capture;
+// shadow results are kept for every light whose position and cone are
+// unchanged, whatever id it ends up with, so only added and moved lights
+// are traced again.
+void addLight(Light light) {
+    // point lights stay ahead of spotlights, as compileLights expects
+    auto firstSpot = find_if(lights.begin(), lights.end(), [](Light& l) { return l.isSpotLight(); });
+    if (light.isSpotLight()) lights.push_back(light);
+    else lights.insert(firstSpot, light);
+    compileLights();
+}
+
+void removeLight(int index) {
+    lights.erase(lights.begin() + index);
+    compileLights();
+}
+
+void moveLight(int index, Vector3D offset) {
+    lights[index].setLightPos(lights[index].getLightPos() + offset);
+    compileLights();
+}
+
+// Forgets the loaded scene and frees all of its objects at once.
+void unloadScene() {
+    closePagedScene();
+    objects.clear();
+    lights.clear();
+    pointLights.clear();
+    spotLights.clear();
+    lightTree.build(pointLights, spotLights);
+    sceneBvh.build(objects);
+    fileOrder.clear();
+    sceneArena.release();
+    sceneGeometryVersion++;
+}
+
+void loadData(string path = "scene.txt") {
+    if (!pagedScenePath.empty()) {
+        loadPagedScene(pagedScenePath);
+        return;
+    }
+
+    ifstream file(path);
+    if (!file) {
+        cerr << "Unable to open file " << path << endl;
         exit(1);
     }
+    // parsed from memory, where readAndSetProperties looking one token ahead costs nothing
+    stringstream input;
+    input << file.rdbuf();
+    file.close();
 
+    unloadScene();
     ReflectionCoefficients floor_coef(.3,.3,.3,.3);
 
     loadSceneParameters(input);
     loadObjects(input);
     loadLights(input);
+    compileLights();
     addFloor(1000, 20, floor_coef);
-
-    input.close();
+    arrangeObjects();
+    sceneBvh.build(objects);
+    sceneGeometryVersion++;
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#ifndef SELFCHECK_H
+#define SELFCHECK_H
+
+#include "1905073_renderer.hpp"
+
+// 64-bit FNV-1a over the pixel bytes; equal images give equal hashes on any machine
+unsigned long long imageHash(bitmap_image& image) {
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    const unsigned char* p = image.data();
+    for (size_t k = 0; k < (size_t)image.width() * image.height() * 3; k++) {
+        h = (h ^ p[k]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+struct CheckedMode {
+    string name;
+    bool wavefront, manyLight, antialiased;
+};
+
+/*
+ * Renders the scene in every render path with 1, 2, 3 and the hardware's
+ * number of threads and checks that each path produces the same bytes for
+ * every thread count. Renders must not depend on the schedule: all random
+ * numbers are seeded per pixel (or per tile and pixel) and every reduction
+ * is an integer count, so any difference here is a bug. A pinned pool
+ * (--numa) is checked as one more thread count and left pinned. Prints one
+ * hash per path for golden-image comparisons and returns non-zero on a
+ * mismatch.
+ */
+int verifyDeterminism() {
+    loadData();
+    camera = Camera();
+    int imageWidth = pixels, imageHeight = pixels;
+
+    vector<CheckedMode> modes = {
+        {"per-pixel", false, false, false},
+        {"wavefront", true, false, false},
+        {"many-light", false, true, false},
+        {"many-light wavefront", true, true, false},
+        {"antialiased", false, false, true},
+    };
+
+    vector<int> threadCounts = {1, 2, 3};
+    int hardware = thread::hardware_concurrency();
+    if (hardware > 3) threadCounts.push_back(hardware);
+    vector<int> pinnedCpus = workers.pinnedCpus(), pinnedNodes = workers.pinnedNodes();
+    int configurations = threadCounts.size() + (pinnedCpus.empty() ? 0 : 1);
+
+    bool savedWavefront = wavefrontMode, savedManyLight = manyLightMode, savedAntialiasing = antialiasing;
+    int mismatches = 0;
+
+    for (CheckedMode& mode : modes) {
+        wavefrontMode = mode.wavefront;
+        manyLightMode = mode.manyLight;
+        antialiasing = mode.antialiased;
+
+        unsigned long long reference = 0;
+        for (int t = 0; t < configurations; t++) {
+            // per-node scene copies are bound to the threads that restarting the pool replaces
+            freeNodeScenes(workers);
+            bool pinned = t == (int)threadCounts.size();
+            if (pinned) workers.pin(pinnedCpus, pinnedNodes);
+            else workers.resize(threadCounts[t]);
+            gbuffer.invalidate();
+
+            bitmap_image image(imageWidth, imageHeight);
+            if (!renderImage(image, imageWidth, imageHeight)) {
+                cerr << mode.name << ": render failed, " << pagedScene.failureReason() << endl;
+                mismatches++;
+                break;
+            }
+            unsigned long long h = imageHash(image);
+
+            if (t == 0) {
+                reference = h;
+            } else if (h != reference) {
+                if (pinned) cerr << mode.name << ": the pinned threads differ from 1 thread" << endl;
+                else cerr << mode.name << ": " << threadCounts[t] << " threads differ from 1 thread" << endl;
+                mismatches++;
+            }
+        }
+
+        cout << mode.name << ": " << hex << setw(16) << setfill('0') << reference << dec << setfill(' ') << endl;
+    }
+
+    wavefrontMode = savedWavefront;
+    manyLightMode = savedManyLight;
+    antialiasing = savedAntialiasing;
+
+    cout << (mismatches ? "Render is NOT deterministic" : "Render is deterministic across thread counts") << endl;
+    return mismatches ? 1 : 0;
+}
+
+#endif // SELFCHECK_H
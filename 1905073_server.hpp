@@ -0,0 +1,331 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/un.h>
+#include "1905073_renderer.hpp"
+#include "1905073_net.hpp"
+
+#define SERVER_PROTOCOL_VERSION 1
+// seconds a client may take to finish sending a request or to accept a reply
+#define CLIENT_TIMEOUT 30
+
+/*
+ * Render daemon protocol. Every message is a uint32 type and a uint32
+ * payload length followed by the payload (see sendMessage), all values in
+ * host byte order; strings and byte blobs carry a uint32 length prefix.
+ *
+ *     SRV_RENDER    u32 version, f64 x 12 camera pos/l/r/u, i32 width,
+ *                   i32 height, i32 recursion level (-1: the scene's),
+ *                   u8 format, string output path (empty: send the image
+ *                   back; otherwise relative to the daemon's output
+ *                   directory, which it may not leave)
+ *     SRV_SHUTDOWN  (empty) stop the daemon
+ *
+ * Replies, one per request:
+ *
+ *     SRV_IMAGE     blob: the encoded image, when the output path is empty
+ *     SRV_WRITTEN   string: path the image was written to
+ *     SRV_ERROR     string: what went wrong
+ */
+enum ServerMessage : uint32_t {
+    SRV_RENDER = 32,
+    SRV_SHUTDOWN,
+    SRV_IMAGE,
+    SRV_WRITTEN,
+    SRV_ERROR
+};
+
+enum ImageFormat : uint8_t {
+    FORMAT_BMP = 0,
+    FORMAT_RGB = 1   // bare rgb24, top row first
+};
+
+// the file bitmap_image::save_image would write, built in memory
+vector<unsigned char> encodeBmp(bitmap_image& image) {
+    int width = image.width(), height = image.height();
+    int rowBytes = (width * 3 + 3) & ~3;
+    uint32_t imageBytes = rowBytes * height;
+
+    MessageBuffer bmp;
+    bmp.put<uint16_t>(19778);          // "BM"
+    bmp.put<uint32_t>(54 + imageBytes);
+    bmp.put<uint32_t>(0);
+    bmp.put<uint32_t>(54);
+    bmp.put<uint32_t>(40);
+    bmp.put<int32_t>(width);
+    bmp.put<int32_t>(height);
+    bmp.put<uint16_t>(1);
+    bmp.put<uint16_t>(24);
+    bmp.put<uint32_t>(0);
+    bmp.put<uint32_t>(imageBytes);
+    for (int i = 0; i < 4; i++) bmp.put<uint32_t>(0);
+
+    // rows bottom-up, each padded to four bytes
+    size_t offset = bmp.bytes.size();
+    bmp.bytes.resize(offset + imageBytes, 0);
+    for (int j = 0; j < height; j++) {
+        memcpy(&bmp.bytes[offset + (height - 1 - j) * rowBytes], image.row(j), width * 3);
+    }
+    return bmp.bytes;
+}
+
+vector<unsigned char> encodeRgb(bitmap_image& image) {
+    int width = image.width(), height = image.height();
+    vector<unsigned char> rgb(width * height * 3);
+    for (int j = 0; j < height; j++) {
+        const unsigned char* bgr = image.row(j);
+        unsigned char* out = &rgb[j * width * 3];
+        for (int i = 0; i < width; i++) {
+            out[3 * i] = bgr[3 * i + 2];
+            out[3 * i + 1] = bgr[3 * i + 1];
+            out[3 * i + 2] = bgr[3 * i];
+        }
+    }
+    return rgb;
+}
+
+// writes bytes to path through a temporary name, so readers never see a partial image
+bool writeFileAtomically(const string& path, const vector<unsigned char>& bytes) {
+    string temporary = path + ".part";
+    {
+        ofstream out(temporary, ios::binary);
+        out.write((const char*)bytes.data(), bytes.size());
+        if (!out.flush()) {
+            remove(temporary.c_str());
+            return false;
+        }
+    }
+    if (rename(temporary.c_str(), path.c_str()) == 0) return true;
+    remove(temporary.c_str());
+    return false;
+}
+
+/*
+ * Render daemon: the scene (and everything built from it, the light tree,
+ * the G-buffer of the last request, the worker pool) stays resident, and
+ * requests only pay for tracing. Clients are served one request at a time
+ * in arrival order; a request for the same camera and size as the previous
+ * one reuses its primary hits. Requests are assembled from whatever the poll
+ * loop reads, so a client that sends half a request never holds up the
+ * others; it is dropped after CLIENT_TIMEOUT seconds. Images are written
+ * to disk only below the output directory the daemon was started with, and
+ * without one only sent back over the socket.
+ */
+class RenderServer {
+    struct Client {
+        int fd;
+        MessageReader reader;
+        chrono::steady_clock::time_point messageStarted;
+        bool open = true;
+    };
+
+    string socketPath;
+    // written images go below outputDir; outputRoot is its real path, "" when there is none
+    string outputDir, outputRoot;
+    int listener = -1;
+    vector<Client> clients;
+    int sceneRecursionLevel;
+
+    void reply(int fd, uint32_t type, const string& text) {
+        MessageBuffer m;
+        m.putString(text);
+        sendMessage(fd, type, m);
+    }
+
+    // outPath inside the output directory, or "" when it is absolute, climbs
+    // out with .., or leads out through a symlinked directory
+    string resolveOutput(const string& outPath) {
+        if (outputRoot.empty() || outPath[0] == '/') return "";
+        stringstream parts(outPath);
+        string part;
+        while (getline(parts, part, '/')) {
+            if (part == "..") return "";
+        }
+
+        string path = outputDir + "/" + outPath;
+        char* real = realpath(path.substr(0, path.rfind('/')).c_str(), nullptr);
+        if (!real) return "";
+        string parent = real;
+        free(real);
+        string prefix = (outputRoot == "/") ? "/" : outputRoot + "/";
+        if (parent != outputRoot && parent.compare(0, prefix.size(), prefix) != 0) return "";
+        return path;
+    }
+
+    void handleRender(int fd, MessageBuffer& request) {
+        uint32_t version = request.get<uint32_t>();
+        if (version != SERVER_PROTOCOL_VERSION) {
+            reply(fd, SRV_ERROR, "Unsupported protocol version " + to_string(version));
+            return;
+        }
+
+        Camera view;
+        for (Vector3D* v : {&view.pos, &view.l, &view.r, &view.u}) {
+            v->x = request.get<double>(), v->y = request.get<double>(), v->z = request.get<double>();
+        }
+        int width = request.get<int32_t>(), height = request.get<int32_t>();
+        int level = request.get<int32_t>();
+        uint8_t format = request.get<uint8_t>();
+        string outPath = request.getString();
+
+        if (request.failed) {
+            reply(fd, SRV_ERROR, "Malformed render request");
+            return;
+        }
+        if (width <= 0 || height <= 0 || (long long)width * height > (MAX_MESSAGE_BYTES / 4)) {
+            reply(fd, SRV_ERROR, "Invalid image size");
+            return;
+        }
+        if (format != FORMAT_BMP && format != FORMAT_RGB) {
+            reply(fd, SRV_ERROR, "Unknown image format " + to_string(format));
+            return;
+        }
+        string writePath;
+        if (!outPath.empty()) {
+            if (outputRoot.empty()) {
+                reply(fd, SRV_ERROR, "This daemon has no output directory; leave the output path empty");
+                return;
+            }
+            writePath = resolveOutput(outPath);
+            if (writePath.empty()) {
+                reply(fd, SRV_ERROR, "Output path must name a file in an existing directory inside the output directory: " + outPath);
+                return;
+            }
+        }
+
+        camera = view;
+        recursion_level = (level < 0) ? sceneRecursionLevel : level;
+
+        bitmap_image image(width, height);
+        if (!renderImage(image, width, height)) {
+            reply(fd, SRV_ERROR, "Render failed: " + pagedScene.failureReason());
+            return;
+        }
+        vector<unsigned char> encoded = (format == FORMAT_BMP) ? encodeBmp(image) : encodeRgb(image);
+
+        if (writePath.empty()) {
+            MessageBuffer m;
+            m.putBytes(encoded.data(), encoded.size());
+            sendMessage(fd, SRV_IMAGE, m);
+        } else if (writeFileAtomically(writePath, encoded)) {
+            reply(fd, SRV_WRITTEN, writePath);
+        } else {
+            reply(fd, SRV_ERROR, "Could not write " + outPath);
+        }
+    }
+
+    // false when the client asked the daemon to stop
+    bool handle(int fd, uint32_t type, MessageBuffer& request) {
+        if (type == SRV_RENDER) handleRender(fd, request);
+        else if (type == SRV_SHUTDOWN) return false;
+        else reply(fd, SRV_ERROR, "Unknown request " + to_string(type));
+        return true;
+    }
+
+    // reads what the client sent and answers each whole request; false on shutdown
+    bool serveClient(Client& client, chrono::steady_clock::time_point now) {
+        if (!client.reader.waiting()) client.messageStarted = now;
+        if (!client.reader.receive(client.fd)) {
+            client.open = false;
+            return true;
+        }
+
+        uint32_t type;
+        MessageBuffer request;
+        while (client.reader.next(type, request)) {
+            if (!handle(client.fd, type, request)) return false;
+            client.messageStarted = now;
+        }
+        if (client.reader.oversized) {
+            reply(client.fd, SRV_ERROR, "Request too large");
+            client.open = false;
+        }
+        return true;
+    }
+
+public:
+    RenderServer(string socketPath, string outputDir = "") : socketPath(socketPath), outputDir(outputDir) {}
+
+    ~RenderServer() {
+        for (Client& client : clients) close(client.fd);
+        if (listener >= 0) {
+            close(listener);
+            unlink(socketPath.c_str());
+        }
+    }
+
+    bool start() {
+        if (!outputDir.empty()) {
+            char* real = realpath(outputDir.c_str(), nullptr);
+            if (!real) {
+                cerr << "Unable to use output directory " << outputDir << ": " << strerror(errno) << endl;
+                return false;
+            }
+            outputRoot = real;
+            free(real);
+        }
+
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            cerr << "Socket path too long: " << socketPath << endl;
+            return false;
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath.c_str());
+        if (listener < 0 || bind(listener, (sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 64) < 0) {
+            cerr << "Unable to listen on " << socketPath << ": " << strerror(errno) << endl;
+            return false;
+        }
+
+        sceneRecursionLevel = recursion_level;
+        return true;
+    }
+
+    void serve() {
+        cout << "Serving renders on " << socketPath;
+        if (!outputRoot.empty()) cout << ", writing images below " << outputRoot;
+        cout << endl;
+
+        while (true) {
+            vector<pollfd> fds = {{listener, POLLIN, 0}};
+            for (Client& client : clients) fds.push_back({client.fd, POLLIN, 0});
+            if (poll(fds.data(), fds.size(), 1000) < 0 && errno != EINTR) return;
+            auto now = chrono::steady_clock::now();
+
+            for (size_t k = 1; k < fds.size(); k++) {
+                Client& client = clients[k - 1];
+                if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                    if (!serveClient(client, now)) {
+                        cout << "Shutting down render server" << endl;
+                        return;
+                    }
+                }
+                if (client.open && client.reader.waiting() && now - client.messageStarted > chrono::seconds(CLIENT_TIMEOUT)) {
+                    cerr << "Dropping a client that stalled mid-request" << endl;
+                    client.open = false;
+                }
+            }
+
+            for (Client& client : clients) {
+                if (!client.open) close(client.fd);
+            }
+            clients.erase(remove_if(clients.begin(), clients.end(), [](Client& c) { return !c.open; }), clients.end());
+
+            if (fds[0].revents & POLLIN) {
+                int fd = accept(listener, nullptr, nullptr);
+                if (fd < 0) continue;
+                // a client that stops reading fails the reply instead of blocking the daemon
+                timeval sendTimeout = {CLIENT_TIMEOUT, 0};
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+                Client client;
+                client.fd = fd;
+                clients.push_back(client);
+            }
+        }
+    }
+};
+
+#endif // SERVER_H
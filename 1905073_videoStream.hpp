@@ -0,0 +1,170 @@
+#ifndef VIDEOSTREAM_H
+#define VIDEOSTREAM_H
+
+#include <csignal>
+#include "bitmap_image.hpp"
+
+using namespace std;
+
+/*
+ * Streams rendered frames to stdout or a file / named pipe so an encoder can
+ * consume them as they are produced, e.g.
+ *
+ *     ./raytracer --animate path.txt --stream y4m - | ffmpeg -i - out.mp4
+ *
+ * "y4m" writes YUV4MPEG2 with 4:2:0 chroma (C420jpeg), "rgb" writes bare
+ * rgb24 frames top row first. Progress messages go to stderr while stdout
+ * carries video.
+ */
+class VideoStream {
+    FILE* out = nullptr;
+    bool y4m = true;
+    int width = 0, height = 0;
+    int fps = 30;
+    vector<unsigned char> r, g, b, frame;
+    // cout's own buffer while it is pointed at stderr, restored by close()
+    streambuf* savedCout = nullptr;
+
+    /*
+     * BT.601 studio-swing conversion in 8.8 fixed point (the integer form of
+     * rgb_to_ycbcr in bitmap_image.hpp). The loops run over planar rows with
+     * no branches and restrict-qualified pointers, so builds with the full
+     * vectorizer cost model (-O3 or -fvect-cost-model=dynamic) get SIMD code
+     * for them; the default -O2 one refuses the widening multiplies.
+     */
+    static void lumaRow(const unsigned char* __restrict r, const unsigned char* __restrict g, const unsigned char* __restrict b,
+                        unsigned char* __restrict y, int n) {
+        for (int i = 0; i < n; i++) {
+            y[i] = (unsigned char)(((66 * r[i] + 129 * g[i] + 25 * b[i] + 128) >> 8) + 16);
+        }
+    }
+
+    // inputs are sums of four pixels, hence the extra >> 2
+    static void chromaRow(const int* __restrict r, const int* __restrict g, const int* __restrict b,
+                          unsigned char* __restrict cb, unsigned char* __restrict cr, int n) {
+        for (int i = 0; i < n; i++) {
+            cb[i] = (unsigned char)(((-38 * r[i] - 74 * g[i] + 112 * b[i] + 512) >> 10) + 128);
+            cr[i] = (unsigned char)(((112 * r[i] - 94 * g[i] - 18 * b[i] + 512) >> 10) + 128);
+        }
+    }
+
+    // one image row split into planar r, g, b
+    void splitRow(bitmap_image& image, int j) {
+        const unsigned char* bgr = image.row(j);
+        for (int i = 0; i < width; i++) {
+            b[i] = bgr[3 * i];
+            g[i] = bgr[3 * i + 1];
+            r[i] = bgr[3 * i + 2];
+        }
+    }
+
+    void convertY4M(bitmap_image& image) {
+        int chromaWidth = (width + 1) / 2, chromaHeight = (height + 1) / 2;
+        unsigned char* yPlane = frame.data();
+        unsigned char* cbPlane = yPlane + width * height;
+        unsigned char* crPlane = cbPlane + chromaWidth * chromaHeight;
+        vector<int> sumR(chromaWidth), sumG(chromaWidth), sumB(chromaWidth);
+
+        for (int cj = 0; cj < chromaHeight; cj++) {
+            fill(sumR.begin(), sumR.end(), 0);
+            fill(sumG.begin(), sumG.end(), 0);
+            fill(sumB.begin(), sumB.end(), 0);
+
+            // odd sizes repeat the last row / column into the 2x2 chroma block
+            for (int dj = 0; dj < 2; dj++) {
+                int j = min(2 * cj + dj, height - 1);
+                splitRow(image, j);
+                if (dj == 0 || 2 * cj + 1 < height) lumaRow(r.data(), g.data(), b.data(), yPlane + j * width, width);
+
+                for (int ci = 0; ci < chromaWidth; ci++) {
+                    int i0 = 2 * ci, i1 = min(2 * ci + 1, width - 1);
+                    sumR[ci] += r[i0] + r[i1];
+                    sumG[ci] += g[i0] + g[i1];
+                    sumB[ci] += b[i0] + b[i1];
+                }
+            }
+
+            chromaRow(sumR.data(), sumG.data(), sumB.data(), cbPlane + cj * chromaWidth, crPlane + cj * chromaWidth, chromaWidth);
+        }
+    }
+
+    void convertRGB(bitmap_image& image) {
+        for (int j = 0; j < height; j++) {
+            const unsigned char* bgr = image.row(j);
+            unsigned char* rgb = frame.data() + j * width * 3;
+            for (int i = 0; i < width; i++) {
+                rgb[3 * i] = bgr[3 * i + 2];
+                rgb[3 * i + 1] = bgr[3 * i + 1];
+                rgb[3 * i + 2] = bgr[3 * i];
+            }
+        }
+    }
+
+public:
+    ~VideoStream() {
+        close();
+    }
+
+    // format is "y4m" or "rgb"; target "-" is stdout
+    bool open(string format, string target, int imageWidth, int imageHeight, int framesPerSecond = 30) {
+        if (format != "y4m" && format != "rgb") {
+            cerr << "Unknown stream format " << format << " (expected y4m or rgb)" << endl;
+            return false;
+        }
+        y4m = (format == "y4m");
+        width = imageWidth;
+        height = imageHeight;
+        fps = framesPerSecond;
+
+        if (target == "-") {
+            out = stdout;
+            savedCout = cout.rdbuf(cerr.rdbuf());
+        } else {
+            out = fopen(target.c_str(), "wb");
+            if (!out) {
+                cerr << "Unable to open " << target << " for streaming" << endl;
+                return false;
+            }
+        }
+
+        // a reader that goes away should fail the next write, not kill the renderer
+        signal(SIGPIPE, SIG_IGN);
+
+        r.resize(width);
+        g.resize(width);
+        b.resize(width);
+        if (y4m) frame.resize(width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2));
+        else frame.resize(width * height * 3);
+
+        if (y4m) {
+            fprintf(out, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+        }
+        return !ferror(out);
+    }
+
+    // false once the stream cannot take more frames
+    bool writeFrame(bitmap_image& image) {
+        if (!out || (int)image.width() != width || (int)image.height() != height) return false;
+
+        if (y4m) {
+            convertY4M(image);
+            fputs("FRAME\n", out);
+        } else {
+            convertRGB(image);
+        }
+
+        if (fwrite(frame.data(), 1, frame.size(), out) != frame.size()) return false;
+        return fflush(out) == 0;
+    }
+
+    void close() {
+        if (savedCout) cout.rdbuf(savedCout);
+        savedCout = nullptr;
+        if (!out) return;
+        if (out != stdout) fclose(out);
+        else fflush(out);
+        out = nullptr;
+    }
+};
+
+#endif // VIDEOSTREAM_H
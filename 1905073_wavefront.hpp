@@ -0,0 +1,386 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "1905073_rayTracing.hpp"
+
+#define WAVEFRONT_TILE 64
+
+/*
+ * Wavefront rendering: instead of following one pixel's path to the end,
+ * every ray of a tile goes through the same stage before the next stage
+ * starts. Each bounce is
+ *
+ *   trace rays -> compact hits -> shade hits (emit shadow and reflection rays)
+ *   -> trace shadow rays -> compact visible lights -> resolve lighting
+ *
+ * and the reflection queue becomes the ray queue of the next bounce.
+ */
+
+// structure-of-arrays queue of rays in flight, pixel is the tile-local index
+struct RayQueue {
+    vector<double> ox, oy, oz;
+    vector<double> dx, dy, dz;
+    vector<double> weight;
+    vector<int> pixel;
+
+    int size() { return pixel.size(); }
+
+    void clear() {
+        ox.clear(); oy.clear(); oz.clear();
+        dx.clear(); dy.clear(); dz.clear();
+        weight.clear();
+        pixel.clear();
+    }
+
+    void push(Ray& ray, int p) {
+        Vector3D o = ray.getOrigin();
+        Vector3D d = ray.getDirection();
+        ox.push_back(o.x); oy.push_back(o.y); oz.push_back(o.z);
+        dx.push_back(d.x); dy.push_back(d.y); dz.push_back(d.z);
+        weight.push_back(ray.getWeight());
+        pixel.push_back(p);
+    }
+
+    // direction is stored normalized already, so it is not renormalized here
+    Ray get(int i) {
+        Vector3D o(ox[i], oy[i], oz[i]);
+        Vector3D d(dx[i], dy[i], dz[i]);
+        Ray ray;
+        ray.setOrigin(o);
+        ray.setDirection(d);
+        ray.setWeight(weight[i]);
+        return ray;
+    }
+
+    // copy of the queue with entry i taken from order[i]
+    RayQueue reordered(vector<int>& order) {
+        RayQueue q;
+        for (int i : order) {
+            Ray ray = get(i);
+            q.push(ray, pixel[i]);
+        }
+        return q;
+    }
+};
+
+/*
+ * Traversal order for a batch of secondary rays: binned by direction
+ * octant, then by the Morton code of the target (the light, for shadow
+ * rays), then by the Morton code of the origin. Rays that end up next to
+ * each other start close together and head the same way, so they touch
+ * the same primitives.
+ */
+vector<int> coherentOrder(RayQueue& q, vector<unsigned int>& targetCodes) {
+    int n = q.size();
+    Vector3D lo(INF, INF, INF), hi(-INF, -INF, -INF);
+    for (int i = 0; i < n; i++) growBounds(Vector3D(q.ox[i], q.oy[i], q.oz[i]), lo, hi);
+
+    struct Key {
+        unsigned int octant, target, origin;
+        int index;
+    };
+    vector<Key> keys(n);
+    for (int i = 0; i < n; i++) {
+        unsigned int octant = (q.dx[i] < 0) << 2 | (q.dy[i] < 0) << 1 | (q.dz[i] < 0);
+        unsigned int target = targetCodes.empty() ? 0 : targetCodes[i];
+        keys[i] = {octant, target, mortonCode(Vector3D(q.ox[i], q.oy[i], q.oz[i]), lo, hi), i};
+    }
+
+    sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+        return tie(a.octant, a.target, a.origin, a.index) < tie(b.octant, b.target, b.origin, b.index);
+    });
+
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) order[i] = keys[i].index;
+    return order;
+}
+
+// rays that hit something, after compaction
+struct HitQueue {
+    vector<int> ray, object;
+    vector<double> t;
+    vector<Vector3D> point, normal;
+    vector<Color> local;
+
+    int size() { return ray.size(); }
+
+    void clear() {
+        ray.clear(); object.clear(); t.clear();
+        point.clear(); normal.clear(); local.clear();
+    }
+};
+
+// one shadow ray per (hit, light) pair that survived the spotlight test
+struct ShadowQueue {
+    RayQueue rays;
+    vector<double> tmax;
+    vector<int> hit, light;
+    // light colour factor, below 1 only in many-light mode
+    vector<double> scale;
+    vector<char> occluded;
+
+    int size() { return hit.size(); }
+
+    void clear() {
+        rays.clear();
+        tmax.clear(); hit.clear(); light.clear(); scale.clear(); occluded.clear();
+    }
+};
+
+class WavefrontRenderer {
+    RayQueue rays, reflected;
+    HitQueue hits;
+    ShadowQueue shadows;
+    vector<int> nearest;
+    vector<double> tNearest;
+    vector<Color> radiance;
+    vector<unsigned int> lightCodes;
+    vector<pair<int, double>> selected;
+    LightBatch batch;
+    unsigned long long tileSeed = 0;
+    vector<LightVisibility>* primaryVisibility = nullptr;
+
+    void traceNearest() {
+        int n = rays.size();
+        nearest.assign(n, -1);
+        tNearest.assign(n, INFINITY);
+
+        // rays arrive in coherent order, so consecutive traversals touch the same nodes
+        for (int i = 0; i < n; i++) {
+            Ray ray = rays.get(i);
+            nearest[i] = nearestObject(ray, tNearest[i]);
+        }
+    }
+
+    void compactHits() {
+        hits.clear();
+        for (int i = 0; i < rays.size(); i++) {
+            if (nearest[i] == -1) continue;
+            hits.ray.push_back(i);
+            hits.object.push_back(nearest[i]);
+            hits.t.push_back(tNearest[i]);
+        }
+    }
+
+    void shadeHits(int level) {
+        shadows.clear();
+        reflected.clear();
+
+        int n = hits.size();
+        hits.point.resize(n);
+        hits.normal.resize(n);
+        hits.local.resize(n);
+
+        for (int h = 0; h < n; h++) {
+            Object* object = objectAt(hits.object[h]);
+            Ray ray = rays.get(hits.ray[h]);
+            Vector3D rd = ray.getDirection();
+
+            Vector3D intersectionPoint = ray.getPointAtParameter(hits.t[h]);
+            Vector3D normal = object->calculateAndNormalizeNormal(intersectionPoint);
+            hits.point[h] = intersectionPoint;
+            hits.normal[h] = normal;
+            hits.local[h] = object->calculateAmbientColor(intersectionPoint);
+
+            seedRandom(tileSeed ^ ((unsigned long long)rays.pixel[hits.ray[h]] << 8) ^ level);
+            selectLights(intersectionPoint, normal, selected);
+
+            LightVisibility* visibility = (level == 1 && primaryVisibility) ? &(*primaryVisibility)[hits.ray[h]] : nullptr;
+
+            for (auto& [li, scale] : selected) {
+                Vector3D lightDir;
+                if (!getRenderLight(li).canReach(intersectionPoint, normal, lightDir)) continue;
+
+                // a known-visible light keeps its record with tmax 0, which no object can block
+                bool visible;
+                bool known = visibility && visibility->lookup(li, visible);
+                if (known && !visible) continue;
+
+                Vector3D lightPos = intersectionPoint + lightDir*0.0000000001;
+                Ray lightRay(lightPos, lightDir);
+
+                shadows.rays.push(lightRay, rays.pixel[hits.ray[h]]);
+                shadows.tmax.push_back(known ? 0.0 : hits.t[h]);
+                shadows.hit.push_back(h);
+                shadows.light.push_back(li);
+                shadows.scale.push_back(scale);
+            }
+
+            if (object->spawnsReflection(ray, level)) {
+                Ray reflectedRay = object->get_reflectedRay(intersectionPoint, normal, rd);
+                reflectedRay.setWeight(ray.getWeight() * object->getCoefficients().getKr());
+                reflected.push(reflectedRay, rays.pixel[hits.ray[h]]);
+            }
+        }
+    }
+
+    void traceShadows(RayQueue& shadowRays, vector<double>& tmax, vector<int>& light, vector<char>& occluded) {
+        int n = shadowRays.size();
+        occluded.assign(n, 0);
+
+        // try each light's last occluder first, most shadowed rays stop here
+        for (int i = 0; i < n; i++) {
+            int cached = cachedOccluder(light[i]);
+            if (cached == -1 || cached >= sceneObjectCount() || tmax[i] <= 0) continue;
+            Ray ray = shadowRays.get(i);
+            double t = intersectObject(cached, ray);
+            if (t > 0 && t < tmax[i]) occluded[i] = 1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (occluded[i] || tmax[i] <= 0) continue;
+            Ray ray = shadowRays.get(i);
+            int blocker = blockingObject(ray, tmax[i]);
+            if (blocker != -1) {
+                occluded[i] = 1;
+                cachedOccluder(light[i]) = blocker;
+            }
+        }
+    }
+
+    void traceShadows() {
+        if (!sortSecondaryRays) {
+            traceShadows(shadows.rays, shadows.tmax, shadows.light, shadows.occluded);
+            return;
+        }
+
+        vector<unsigned int> targets(shadows.size());
+        for (int i = 0; i < shadows.size(); i++) targets[i] = lightCodes[shadows.light[i]];
+        vector<int> order = coherentOrder(shadows.rays, targets);
+
+        RayQueue sortedRays = shadows.rays.reordered(order);
+        vector<double> sortedTmax(order.size());
+        vector<int> sortedLight(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            sortedTmax[i] = shadows.tmax[order[i]];
+            sortedLight[i] = shadows.light[order[i]];
+        }
+
+        vector<char> sortedOccluded;
+        traceShadows(sortedRays, sortedTmax, sortedLight, sortedOccluded);
+
+        // scatter back so resolveLighting still sees (hit, light) order
+        shadows.occluded.assign(order.size(), 0);
+        for (size_t i = 0; i < order.size(); i++) shadows.occluded[order[i]] = sortedOccluded[i];
+    }
+
+    void sortReflectedRays() {
+        vector<unsigned int> noTargets;
+        vector<int> order = coherentOrder(reflected, noTargets);
+        reflected = reflected.reordered(order);
+    }
+
+    void computeLightCodes() {
+        Vector3D lo(INF, INF, INF), hi(-INF, -INF, -INF);
+        for (int li = 0; li < (int)lights.size(); li++) growBounds(getRenderLight(li).pos, lo, hi);
+
+        lightCodes.resize(lights.size());
+        for (int li = 0; li < (int)lights.size(); li++) lightCodes[li] = mortonCode(getRenderLight(li).pos, lo, hi);
+    }
+
+    void recordVisibility() {
+        for (int i = 0; i < shadows.size(); i++) {
+            int r = hits.ray[shadows.hit[i]];
+            (*primaryVisibility)[r].record(shadows.light[i], !shadows.occluded[i]);
+        }
+    }
+
+    void compactShadows() {
+        int kept = 0;
+        for (int i = 0; i < shadows.size(); i++) {
+            if (shadows.occluded[i]) continue;
+            shadows.hit[kept] = shadows.hit[i];
+            shadows.light[kept] = shadows.light[i];
+            shadows.scale[kept] = shadows.scale[i];
+            kept++;
+        }
+        shadows.hit.resize(kept);
+        shadows.light.resize(kept);
+        shadows.scale.resize(kept);
+    }
+
+    // shadow records are in (hit, light) order, so lights accumulate in the same order as per-pixel shading
+    void resolveLighting() {
+        for (int i = 0; i < (int)shadows.hit.size(); ) {
+            int h = shadows.hit[i];
+            Object* object = objectAt(hits.object[h]);
+            Vector3D rd(rays.dx[hits.ray[h]], rays.dy[hits.ray[h]], rays.dz[hits.ray[h]]);
+
+            // the lights of one hit are consecutive records
+            batch.count = 0;
+            for (; i < (int)shadows.hit.size() && shadows.hit[i] == h; i++) {
+                RenderLight& l = getRenderLight(shadows.light[i]);
+                Vector3D lightDir = l.pos - hits.point[h];
+                lightDir.normalize();
+
+                batch.add(lightDir, l.color * shadows.scale[i]);
+                if (batch.full()) object->shadeLights(batch, hits.normal[h], rd, hits.local[h], hits.point[h]);
+            }
+            if (batch.count) object->shadeLights(batch, hits.normal[h], rd, hits.local[h], hits.point[h]);
+        }
+
+        for (int h = 0; h < hits.size(); h++) {
+            hits.local[h].fix();
+            int r = hits.ray[h];
+            radiance[rays.pixel[r]] = radiance[rays.pixel[r]] + hits.local[h] * rays.weight[r];
+        }
+    }
+
+public:
+    // reorder shadow and reflection rays for coherence before tracing them
+    bool sortSecondaryRays = true;
+
+    // rays for the current tile, filled by the caller with tile-local pixel indices
+    RayQueue& primaryRays() { return rays; }
+
+    // Runs every bounce of the queued primary rays; returns radiance per
+    // tile-local pixel. tileId seeds light sampling. primaryHits holds one
+    // entry per primary ray: read instead of tracing when reusePrimaryHits,
+    // filled in otherwise. visibility, when given, is per primary ray too
+    // and replaces the shadow rays of first hits it already knows.
+    vector<Color>& traceTile(int tilePixels, int tileId, vector<SurfaceHit>& primaryHits, bool reusePrimaryHits,
+                             vector<LightVisibility>* visibility = nullptr) {
+        radiance.assign(tilePixels, Color());
+        tileSeed = mixBits(tileId);
+        primaryVisibility = visibility;
+        if (sortSecondaryRays) computeLightCodes();
+
+        for (int level = 1; rays.size() > 0; level++) {
+            if (level == 1 && reusePrimaryHits) {
+                nearest.resize(rays.size());
+                tNearest.resize(rays.size());
+                for (int i = 0; i < rays.size(); i++) {
+                    nearest[i] = primaryHits[i].object;
+                    tNearest[i] = primaryHits[i].t;
+                }
+            } else {
+                traceNearest();
+            }
+            compactHits();
+            shadeHits(level);
+
+            if (level == 1 && !reusePrimaryHits) {
+                for (int i = 0; i < rays.size(); i++) primaryHits[i] = SurfaceHit();
+                for (int h = 0; h < hits.size(); h++) {
+                    SurfaceHit& hit = primaryHits[hits.ray[h]];
+                    hit.object = hits.object[h];
+                    hit.t = hits.t[h];
+                    hit.point = hits.point[h];
+                    hit.normal = hits.normal[h];
+                }
+            }
+
+            traceShadows();
+            if (level == 1 && primaryVisibility) recordVisibility();
+            compactShadows();
+            resolveLighting();
+            if (sortSecondaryRays) sortReflectedRays();
+            swap(rays, reflected);
+        }
+
+        for (Color& c : radiance) c.fix();
+        return radiance;
+    }
+};
+
+#endif // WAVEFRONT_H
@@ -0,0 +1,193 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
+
+using namespace std;
+
+/*
+ * Fixed set of render threads that live for the whole process. run() hands
+ * them a batch of tasks, which they pull one at a time, and returns once
+ * every task has finished. Keeping the threads alive means a capture, or
+ * every frame of an animation, pays no thread start-up cost.
+ *
+ * Which worker runs a task, and in what order, varies from run to run, so a
+ * task's result must depend only on the task: seed randomness from the
+ * pixel and keep shared tallies to integer counters. --verify-determinism
+ * checks that renders come out the same for any pool size.
+ *
+ * A pinned pool (see pin()) binds worker w to one CPU of a NUMA node and
+ * gives every node a contiguous share of the tasks, sized by its worker
+ * count. The node's workers claim its tasks one at a time as above, and
+ * only help the other nodes once their own share is done, so the same
+ * tiles of every frame are traced, and their memory first touched, on the
+ * same node without a slow tile holding up a whole static block.
+ */
+class WorkerPool {
+    vector<thread> threads;
+    mutex lock;
+    condition_variable wake, done;
+
+    function<void(int, int)> job;
+    int taskCount = 0;
+    atomic<int> nextTask{0};
+    int active = 0;
+    unsigned long long generation = 0;
+    bool stopping = false;
+
+    // cpu and node of each worker when pinned, empty otherwise
+    vector<int> placement, nodeOf;
+    // per node when pinned: workers, end of its share of the tasks and the next task to claim
+    vector<int> nodeWorkers, nodeEnd;
+    unique_ptr<atomic<int>[]> nodeNext;
+    // the job runs once on every worker rather than once per task
+    bool eachWorker = false;
+
+    // seen is the generation when the thread was started: earlier jobs are not its to run
+    void work(int worker, unsigned long long seen) {
+
+        if (!placement.empty()) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(placement[worker], &cpus);
+            pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        }
+
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+            }
+
+            if (eachWorker) {
+                job(worker, worker);
+            } else if (placement.empty()) {
+                for (int task = nextTask++; task < taskCount; task = nextTask++) job(task, worker);
+            } else {
+                // the worker's own node first, then whatever the other nodes have left
+                int nodes = nodeEnd.size();
+                for (int k = 0; k < nodes; k++) {
+                    int node = (nodeOf[worker] + k) % nodes;
+                    for (int task = nodeNext[node]++; task < nodeEnd[node]; task = nodeNext[node]++) job(task, worker);
+                }
+            }
+
+            {
+                lock_guard<mutex> guard(lock);
+                if (--active == 0) done.notify_all();
+            }
+        }
+    }
+
+    void start(int count) {
+        unsigned long long current;
+        {
+            lock_guard<mutex> guard(lock);
+            current = generation;
+        }
+        for (int w = 0; w < count; w++) threads.emplace_back(&WorkerPool::work, this, w, current);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread& t : threads) t.join();
+        threads.clear();
+        stopping = false;
+    }
+
+    // hands f to the workers and waits for them; each: once per worker, not per task
+    void dispatch(int tasks, function<void(int, int)> f, bool each) {
+        if (threads.empty()) resize(thread::hardware_concurrency());
+
+        unique_lock<mutex> guard(lock);
+        job = f;
+        taskCount = tasks;
+        eachWorker = each;
+        nextTask = 0;
+        int begin = 0, workersBefore = 0;
+        for (int node = 0; node < (int)nodeEnd.size(); node++) {
+            workersBefore += nodeWorkers[node];
+            nodeNext[node] = begin;
+            nodeEnd[node] = begin = (long long)tasks * workersBefore / threads.size();
+        }
+        active = threads.size();
+        generation++;
+        wake.notify_all();
+        done.wait(guard, [&] { return active == 0; });
+    }
+
+public:
+    ~WorkerPool() {
+        stop();
+    }
+
+    int size() {
+        return threads.size();
+    }
+
+    // (re)starts the pool with count unpinned threads, no-op if it already has them
+    void resize(int count) {
+        count = max(count, 1);
+        if (count == size() && placement.empty()) return;
+
+        stop();
+        placement.clear();
+        nodeOf.clear();
+        nodeWorkers.clear();
+        nodeEnd.clear();
+        start(count);
+    }
+
+    // restarts the pool with one thread bound to each of cpus, in that order;
+    // nodes gives the NUMA node of each cpu
+    void pin(vector<int> cpus, vector<int> nodes) {
+        if (cpus.empty()) return;
+
+        stop();
+        placement = cpus;
+        nodeOf = nodes;
+        int nodeCount = *max_element(nodes.begin(), nodes.end()) + 1;
+        nodeWorkers.assign(nodeCount, 0);
+        for (int node : nodes) nodeWorkers[node]++;
+        nodeEnd.assign(nodeCount, 0);
+        nodeNext.reset(new atomic<int>[nodeCount]);
+        start(cpus.size());
+    }
+
+    bool pinned() {
+        return !placement.empty();
+    }
+
+    // cpus and nodes of the last pin(), empty for an unpinned pool
+    vector<int> pinnedCpus() {
+        return placement;
+    }
+
+    vector<int> pinnedNodes() {
+        return nodeOf;
+    }
+
+    // Runs f(task, worker) for every task in [0, tasks); worker is in [0, size()).
+    void run(int tasks, function<void(int, int)> f) {
+        dispatch(tasks, f, false);
+    }
+
+    // Runs f(worker) once on every worker, for per-thread state.
+    void runOnEach(function<void(int)> f) {
+        dispatch(size(), [&](int task, int worker) { f(worker); }, true);
+    }
+};
+
+#endif // WORKERS_H